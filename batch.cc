@@ -0,0 +1,313 @@
+#include <string>
+#include <vector>
+#include <sstream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <exception>
+#include <algorithm>
+#include <cstring>
+
+#ifdef _WIN32
+# include <fstream>
+# include <iostream>
+#else
+# include <cerrno>
+# include <fcntl.h>
+# include <unistd.h>
+# include <sys/stat.h>
+# include <sys/mman.h>
+#endif
+
+#include "batch.hh"
+#include "prefilter.hh"
+
+/* Batch driver for regex-opt */
+/* Copyright (C) 1992,2006 Bisqwit (http://iki.fi/bisqwit/) */
+
+namespace {
+
+/* The whole input, either mapped to memory
+ * (regular files) or read into a buffer (pipes). */
+class InputFile
+{
+public:
+    explicit InputFile(const char* filename);
+    ~InputFile();
+
+    const char* data() const { return ptr; }
+    std::size_t size() const { return len; }
+
+private:
+    const char* ptr;
+    std::size_t len;
+    void* map;
+    std::string buffer;
+
+    InputFile(const InputFile&);
+    void operator= (const InputFile&);
+};
+
+#ifdef _WIN32
+InputFile::InputFile(const char* filename): ptr(0), len(0), map(0), buffer()
+{
+    std::ostringstream tmp;
+    if(std::string(filename) == "-")
+        tmp << std::cin.rdbuf();
+    else
+    {
+        std::ifstream f(filename, std::ios::binary);
+        if(!f) throw std::string("Cannot open ") + filename;
+        tmp << f.rdbuf();
+    }
+    buffer = tmp.str();
+    ptr = buffer.data();
+    len = buffer.size();
+}
+InputFile::~InputFile()
+{
+}
+#else
+InputFile::InputFile(const char* filename): ptr(0), len(0), map(0), buffer()
+{
+    bool is_stdin = std::string(filename) == "-";
+    int fd = is_stdin ? 0 : open(filename, O_RDONLY);
+    if(fd < 0) throw std::string("Cannot open ") + filename + ": " + std::strerror(errno);
+
+    struct stat st;
+    if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+    {
+        void* p = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(p != MAP_FAILED)
+        {
+            madvise(p, st.st_size, MADV_SEQUENTIAL);
+            map = p;
+            ptr = static_cast<const char*>(p);
+            len = st.st_size;
+        }
+    }
+    if(!map)
+    {
+        char buf[65536];
+        for(;;)
+        {
+            ssize_t n = read(fd, buf, sizeof(buf));
+            if(n < 0 && errno == EINTR) continue;
+            if(n < 0)
+            {
+                std::string error = std::strerror(errno);
+                if(!is_stdin) close(fd);
+                throw std::string("Cannot read ") + filename + ": " + error;
+            }
+            if(n == 0) break;
+            buffer.append(buf, n);
+        }
+        ptr = buffer.data();
+        len = buffer.size();
+    }
+    if(!is_stdin) close(fd);
+}
+InputFile::~InputFile()
+{
+    if(map) munmap(map, len);
+}
+#endif
+
+struct Record
+{
+    const char* begin;
+    std::size_t length;
+};
+
+struct Result
+{
+    std::string text;
+    std::string error; // empty if successful
+    bool partial;      // the budget ran out
+    std::vector<std::string> warnings;
+
+    Result(): text(), error(), partial(false), warnings() { }
+};
+
+/* Records are handed out to the threads in chunks of this many. */
+static const std::size_t ChunkSize = 32;
+
+class BatchRunner
+{
+public:
+    BatchRunner(const std::vector<Record>& r, const regexopt_batch_settings& s)
+        : records(r), options(s.options), possessive(s.possessive),
+          emitter(s.emitter ? *s.emitter : RegexOptPerlEmitter()), prefilter(s.prefilter),
+          delimiter(s.delimiter), results(r.size()),
+          num_chunks((r.size() + ChunkSize-1) / ChunkSize),
+          next_chunk(0), done(num_chunks), lock(), finished()
+    {
+    }
+
+    /* Processes chunks until none remain. Run by each thread.
+     * The statistics, if wanted, are summed up at the end. */
+    void Work()
+    {
+        regexopt_arena arena;
+        regexopt_stats stats;
+        regexopt_options local = options;
+        if(options.stats) local.stats = &stats;
+        local.threads = 1; // the records are spread over the threads already
+        for(;;)
+        {
+            std::size_t c = next_chunk++;
+            if(c >= num_chunks) break;
+
+            std::size_t end = std::min(records.size(), (c+1) * ChunkSize);
+            for(std::size_t a = c * ChunkSize; a < end; ++a)
+            {
+                Process(records[a], results[a], arena, local);
+                arena.Clear();
+            }
+
+            std::lock_guard<std::mutex> guard(lock);
+            done[c] = true;
+            finished.notify_all();
+        }
+        if(options.stats)
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            *options.stats += stats;
+        }
+    }
+
+    /* Blocks until the given chunk is done, and returns its results. */
+    Result* WaitChunk(std::size_t c, std::size_t& count)
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        while(!done[c]) finished.wait(guard);
+        count = std::min(records.size(), (c+1) * ChunkSize) - c * ChunkSize;
+        return &results[c * ChunkSize];
+    }
+
+    std::size_t chunks() const { return num_chunks; }
+
+private:
+    const std::vector<Record>& records;
+    const regexopt_options& options;
+    const bool possessive;
+    const regexopt_emitter& emitter;
+    const bool prefilter;
+    const char delimiter;
+    std::vector<Result> results;
+    const std::size_t num_chunks;
+
+    std::atomic<std::size_t> next_chunk;
+    std::vector<char> done; // guarded by lock
+    std::mutex lock;
+    std::condition_variable finished;
+
+    void Process(const Record& rec, Result& result, regexopt_arena& arena,
+                 const regexopt_options& options)
+    {
+        try
+        {
+            unsigned pos = 0;
+            regexopt_options local = options;
+            local.partial = &result.partial;
+            regexopt_choices tree = RegexOptParse(rec.begin, rec.length, pos, arena, local);
+            std::vector<regexopt_backtracking_warning> warnings;
+            if(possessive) warnings = RegexOptGuardBacktracking(tree, arena, emitter);
+            std::ostringstream out;
+            DumpRegexOptTree(out, tree, arena, emitter);
+            result.text = out.str();
+            /* ERE cannot escape a newline, and a raw one would
+             * split the result over two output lines. */
+            if(delimiter == '\n' && result.text.find('\n') != std::string::npos)
+                throw "the result needs a raw newline, which cannot be written on one line";
+            for(std::size_t a=0; a<warnings.size(); ++a)
+                result.warnings.push_back(DescribeRegexOptWarning(warnings[a], result.text));
+            if(prefilter)
+            {
+                std::ostringstream json;
+                DumpRegexOptPrefilter(json, RegexOptPrefilter(tree, arena), result.text);
+                result.text = json.str();
+            }
+        }
+        catch(const char* s)        { result.error = s; }
+        catch(const std::string& s) { result.error = s; }
+        catch(const std::exception& e) { result.error = e.what(); }
+        if(!result.error.empty()) result.text.clear();
+    }
+
+    BatchRunner(const BatchRunner&);
+    void operator= (const BatchRunner&);
+};
+
+static void SplitRecords(const InputFile& input, char delimiter, std::vector<Record>& records)
+{
+    const char* p   = input.data();
+    const char* end = p + input.size();
+    while(p < end)
+    {
+        const char* q = static_cast<const char*>(std::memchr(p, delimiter, end - p));
+        if(!q) q = end;
+
+        Record rec;
+        rec.begin  = p;
+        rec.length = q - p;
+        if(delimiter == '\n' && rec.length && p[rec.length-1] == '\r') --rec.length;
+        records.push_back(rec);
+
+        p = q + 1;
+    }
+}
+
+} // namespace
+
+unsigned long RegexOptBatch(const char* filename,
+                            const regexopt_batch_settings& settings,
+                            std::ostream& out, std::ostream& err)
+{
+    InputFile input(filename);
+    std::vector<Record> records;
+    SplitRecords(input, settings.delimiter, records);
+
+    BatchRunner runner(records, settings);
+
+    unsigned threads = settings.threads ? settings.threads : std::thread::hardware_concurrency();
+    if(!threads) threads = 1;
+    if(threads > runner.chunks()) threads = runner.chunks();
+
+    std::vector<std::thread> pool;
+    if(threads <= 1)
+        runner.Work();
+    else
+        for(unsigned a=0; a<threads; ++a)
+            pool.push_back(std::thread(&BatchRunner::Work, &runner));
+
+    /* Write the results in order while the pool keeps working. */
+    unsigned long failed = 0, line = 0;
+    for(std::size_t c=0; c<runner.chunks(); ++c)
+    {
+        std::size_t count;
+        Result* results = runner.WaitChunk(c, count);
+        for(std::size_t a=0; a<count; ++a)
+        {
+            Result& r = results[a];
+            ++line;
+            if(!r.error.empty())
+            {
+                err << filename << ':' << line << ": " << r.error << '\n';
+                ++failed;
+            }
+            else if(r.partial)
+                err << filename << ':' << line << ": budget exhausted, result is partially optimized\n";
+            for(std::size_t w=0; w<r.warnings.size(); ++w)
+                err << filename << ':' << line << ": warning: " << r.warnings[w] << '\n';
+            out.write(r.text.data(), r.text.size());
+            out.put(settings.delimiter);
+            std::string().swap(r.text);
+        }
+    }
+    for(std::size_t a=0; a<pool.size(); ++a)
+        pool[a].join();
+    out.flush();
+    return failed;
+}
@@ -0,0 +1,43 @@
+#ifndef bqtBatchHH
+#define bqtBatchHH
+
+#include <ostream>
+#include "libregex.hh"
+
+/***************
+ *
+ * Batch mode: optimizes many regexps, one per record, from
+ * a file (memory-mapped) or from stdin ("-"). The records are
+ * distributed to a pool of threads, each with its own arena,
+ * and the results are written in input order, each followed
+ * by the delimiter.
+ *
+ * A record that fails to parse, or whose result would contain
+ * a newline when that is the delimiter, produces an empty result
+ * and a message on err; the rest of the batch is still processed.
+ */
+struct regexopt_batch_settings
+{
+    char delimiter;   // '\n' or '\0'
+    unsigned threads; // 0 = one per CPU
+    bool possessive;  // apply RegexOptGuardBacktracking, reporting its warnings
+    const regexopt_emitter* emitter; // 0 = RegexOptPerlEmitter()
+    bool prefilter;   // write each result with its prefilter, as JSON
+    regexopt_options options;
+
+    regexopt_batch_settings(): delimiter('\n'), threads(0), possessive(false),
+                               emitter(0), prefilter(false), options() { }
+};
+
+/* The budget in options applies to each record separately.
+ * Records whose budget ran out, and the backtracking warnings,
+ * are reported on err, but the (valid) results are written and
+ * they are not failures.
+ *
+ * Returns the number of records that failed. Throws a
+ * std::string if the input cannot be read. */
+unsigned long RegexOptBatch(const char* filename,
+                            const regexopt_batch_settings& settings,
+                            std::ostream& out, std::ostream& err);
+
+#endif
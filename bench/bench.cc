@@ -0,0 +1,444 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <set>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <cstdlib>
+
+#ifndef _WIN32
+# include <sys/resource.h>
+#endif
+
+#include "libregex.hh"
+#include "dfa.hh"
+#include "rangeset.hh"
+
+/* Benchmark driver for regex-opt */
+/* Copyright (C) 1992,2006 Bisqwit (http://iki.fi/bisqwit/) */
+
+/* Runs one benchmark case per invocation (so that the peak RSS
+ * belongs to that case alone), timing parse, optimize and dump
+ * separately, and prints the result as one line of JSON:
+ *
+ *   {"case":"keywords-10k","input_bytes":...,"output_bytes":...,
+ *    "iterations":...,"parse_ms":...,"optimize_ms":...,"dump_ms":...,
+ *    "total_ms":...,"ops_per_sec":...,"peak_rss_kb":...}
+ *
+ * The scan cases instead compile the optimized regexp into a DFA
+ * and find all the (non-overlapping) matches in a generated text:
+ *
+ *   {"case":"keywords-1k-scan","input_bytes":...,"dfa_states":...,
+ *    "classes":...,"iterations":...,"compile_ms":...,"scan_bytes":...,
+ *    "matches":...,"scan_ms":...,"scan_mb_per_s":...,"peak_rss_kb":...}
+ *
+ * The ranges cases time the rangesets that CountingCombineTree
+ * builds, with the std::map and the flat storage, on the same sets
+ * of counts (a few small ranges each, some of them open-ended):
+ *
+ *   {"case":"ranges-flat","builds":...,"ranges":...,"iterations":...,
+ *    "build_ms":...,"ns_per_build":...,"peak_rss_kb":...}
+ *
+ * The times are medians over the iterations. Each case runs
+ * for at least three iterations and at least --min-time seconds.
+ *
+ * The generated inputs come from a fixed-seed generator, so they
+ * are the same on every run and every machine.
+ */
+
+namespace {
+
+class Random
+{
+public:
+    explicit Random(unsigned long long seed): state(seed) { }
+    unsigned operator() (unsigned limit)
+    {
+        // xorshift64*
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        return (unsigned)((state * 0x2545F4914F6CDD1DULL) >> 33) % limit;
+    }
+private:
+    unsigned long long state;
+};
+
+std::string CorpusDir = "bench";
+
+std::string ReadFile(const std::string& name)
+{
+    std::ifstream f(name.c_str(), std::ios::binary);
+    if(!f) throw std::string("Cannot open ") + name;
+    std::ostringstream tmp;
+    tmp << f.rdbuf();
+    std::string s = tmp.str();
+    while(!s.empty() && (s[s.size()-1] == '\n' || s[s.size()-1] == '\r'))
+        s.erase(s.size()-1);
+    return s;
+}
+
+/* Abigail-style URL regexp (RFC 1738, fully expanded). */
+std::string MakeUrl()
+{
+    return ReadFile(CorpusDir + "/url.regex");
+}
+
+/* An alternation of n distinct lowercase words, 3 to 12 letters. */
+std::string MakeKeywords(unsigned n)
+{
+    Random rnd(n);
+    std::set<std::string> seen;
+    std::string result;
+    while(seen.size() < n)
+    {
+        std::string word;
+        unsigned len = 3 + rnd(10);
+        for(unsigned a=0; a<len; ++a) word += (char)('a' + rnd(26));
+        if(!seen.insert(word).second) continue;
+        if(!result.empty()) result += '|';
+        result += word;
+    }
+    return result;
+}
+
+/* Alternations nested 150 levels deep, each level offering
+ * something to factor out: (?:kq(?:...)|krc|kqr+|q[0-9]r) */
+std::string MakeNesting()
+{
+    Random rnd(150);
+    std::string s = "core";
+    for(unsigned depth=0; depth<150; ++depth)
+    {
+        char p = 'a' + rnd(26), q = 'a' + rnd(26), r = 'a' + rnd(26);
+        std::string t = "(?:";
+        t += p; t += q; t += s;
+        t += '|'; t += p; t += r; t += 'c';
+        t += '|'; t += p; t += q; t += r; t += '+';
+        t += '|'; t += q; t += "[0-9]"; t += r;
+        t += ')';
+        s = t;
+    }
+    return s;
+}
+
+/* A 20000-character literal made of repeated blocks, for
+ * the tandem-repeat search of HeavyCompressSequence. */
+std::string MakeRepeats()
+{
+    Random rnd(20000);
+    std::string s;
+    while(s.size() < 20000)
+    {
+        std::string block;
+        unsigned len = 1 + rnd(8);
+        for(unsigned a=0; a<len; ++a) block += (char)('a' + rnd(4));
+        unsigned times = 1 + rnd(5);
+        for(unsigned a=0; a<times; ++a) s += block;
+    }
+    return s;
+}
+
+/* 16 MB of lowercase words and punctuation. */
+std::string MakeScanText()
+{
+    Random rnd(16);
+    static const char punct[] = " .,:/-";
+    std::string s;
+    while(s.size() < 16u << 20)
+    {
+        unsigned len = 1 + rnd(10);
+        for(unsigned a=0; a<len; ++a) s += (char)('a' + rnd(26));
+        s += punct[rnd(sizeof(punct)-1)];
+    }
+    return s;
+}
+
+/* The count ranges of 100000 groups of alternatives, 2 to 15
+ * alternatives each, as {min, max+1} with ~0u for no maximum,
+ * and a {0,0} after each group. */
+std::vector<std::pair<unsigned, unsigned> > MakeCountRanges()
+{
+    Random rnd(100000);
+    std::vector<std::pair<unsigned, unsigned> > result;
+    for(unsigned group=0; group<100000; ++group)
+    {
+        unsigned n = 2 + rnd(14);
+        for(unsigned a=0; a<n; ++a)
+        {
+            unsigned min = rnd(8);
+            unsigned up  = rnd(6) ? min + 1 + rnd(4) : ~0u;
+            result.push_back(std::make_pair(min, up));
+        }
+        result.push_back(std::make_pair(0u, 0u));
+    }
+    return result;
+}
+
+struct Case
+{
+    const char* name;
+    std::string (*make)();
+    bool scan;
+    void (*run)(const Case& c, double min_time); // instead of make, if given
+};
+
+std::string Keywords1k()   { return MakeKeywords(1000); }
+std::string Keywords10k()  { return MakeKeywords(10000); }
+std::string Keywords100k() { return MakeKeywords(100000); }
+
+double Median(std::vector<double> v)
+{
+    std::sort(v.begin(), v.end());
+    std::size_t n = v.size();
+    return n % 2 ? v[n/2] : (v[n/2-1] + v[n/2]) / 2;
+}
+
+long PeakRSS()
+{
+#ifndef _WIN32
+    struct rusage usage;
+    if(getrusage(RUSAGE_SELF, &usage) == 0) return usage.ru_maxrss; // kB on Linux
+#endif
+    return -1;
+}
+
+template<typename Ranges>
+void RunRanges(const Case& c, double min_time)
+{
+    typedef std::chrono::steady_clock clock;
+    const std::vector<std::pair<unsigned, unsigned> > counts = MakeCountRanges();
+
+    std::vector<double> build;
+    unsigned long builds = 0, ranges = 0;
+    double elapsed = 0;
+    while(build.size() < 3 || elapsed < min_time)
+    {
+        builds = ranges = 0;
+        clock::time_point t0 = clock::now();
+        Ranges set;
+        for(std::size_t a=0; a<counts.size(); ++a)
+        {
+            if(counts[a].second)
+            {
+                set.set(counts[a].first, counts[a].second);
+                continue;
+            }
+            for(typename Ranges::const_iterator i = set.begin(); i != set.end(); ++i)
+                ++ranges;
+            set.clear();
+            ++builds;
+        }
+        clock::time_point t1 = clock::now();
+
+        std::chrono::duration<double, std::milli> b(t1-t0);
+        build.push_back(b.count());
+        elapsed += b.count() / 1000.0;
+    }
+
+    double t = Median(build);
+    std::cout.setf(std::ios::fixed);
+    std::cout.precision(3);
+    std::cout << "{\"case\":\"" << c.name << "\""
+              << ",\"builds\":"       << builds
+              << ",\"ranges\":"       << ranges
+              << ",\"iterations\":"   << build.size()
+              << ",\"build_ms\":"     << t
+              << ",\"ns_per_build\":" << (builds ? t * 1e6 / builds : 0.0)
+              << ",\"peak_rss_kb\":"  << PeakRSS()
+              << "}" << std::endl;
+}
+
+const Case Cases[] =
+{
+    { "url",           MakeUrl,      false, 0 },
+    { "keywords-1k",   Keywords1k,   false, 0 },
+    { "keywords-10k",  Keywords10k,  false, 0 },
+    { "keywords-100k", Keywords100k, false, 0 },
+    { "nesting",       MakeNesting,  false, 0 },
+    { "repeats",       MakeRepeats,  false, 0 },
+    { "keywords-1k-scan", Keywords1k, true, 0 },
+    { "ranges-map",    0, false, RunRanges<rangeset<unsigned> > },
+    { "ranges-flat",   0, false, RunRanges<rangeset<unsigned, flat_ranges<8> > > },
+};
+const unsigned NumCases = sizeof(Cases) / sizeof(*Cases);
+
+void RunScan(const Case& c, const std::string& input, double min_time)
+{
+    typedef std::chrono::steady_clock clock;
+    const std::string text = MakeScanText();
+
+    regexopt_arena arena;
+    unsigned pos = 0;
+    regexopt_choices tree = RegexOptParse(input, pos, arena);
+
+    std::vector<double> compile, scan;
+    unsigned states = 0, classes = 0;
+    std::size_t matches = 0;
+    double elapsed = 0;
+    while(scan.size() < 3 || elapsed < min_time)
+    {
+        clock::time_point t0 = clock::now();
+        regexopt_dfa dfa(tree, arena);
+        clock::time_point t1 = clock::now();
+        matches = 0;
+        for(std::size_t p = 0; p < text.size(); )
+        {
+            std::size_t end = dfa.Find(text.data() + p, text.size() - p);
+            if(end == regexopt_dfa::npos) break;
+            ++matches;
+            p += end ? end : 1;
+        }
+        clock::time_point t2 = clock::now();
+
+        states  = dfa.states();
+        classes = dfa.classes();
+
+        std::chrono::duration<double, std::milli> p(t1-t0), s(t2-t1);
+        compile.push_back(p.count());
+        scan.push_back(s.count());
+        elapsed += (p.count() + s.count()) / 1000.0;
+    }
+
+    double t = Median(scan);
+    std::cout.setf(std::ios::fixed);
+    std::cout.precision(3);
+    std::cout << "{\"case\":\"" << c.name << "\""
+              << ",\"input_bytes\":"   << input.size()
+              << ",\"dfa_states\":"    << states
+              << ",\"classes\":"       << classes
+              << ",\"iterations\":"    << scan.size()
+              << ",\"compile_ms\":"    << Median(compile)
+              << ",\"scan_bytes\":"    << text.size()
+              << ",\"matches\":"       << matches
+              << ",\"scan_ms\":"       << t
+              << ",\"scan_mb_per_s\":" << (t > 0 ? text.size() / 1048576.0 / (t / 1000.0) : 0.0)
+              << ",\"peak_rss_kb\":"   << PeakRSS()
+              << "}" << std::endl;
+}
+
+void Run(const Case& c, double min_time)
+{
+    typedef std::chrono::steady_clock clock;
+    if(c.run)
+    {
+        c.run(c, min_time);
+        return;
+    }
+    const std::string input = c.make();
+    if(c.scan)
+    {
+        RunScan(c, input, min_time);
+        return;
+    }
+
+    /* The split pipeline must give what RegexOptParse gives. */
+    std::string expected;
+    {
+        regexopt_arena arena;
+        unsigned pos = 0;
+        regexopt_choices tree = RegexOptParse(input, pos, arena);
+        std::ostringstream out;
+        DumpRegexOptTree(out, tree, arena);
+        expected = out.str();
+    }
+
+    std::vector<double> parse, optimize, dump, total;
+    std::size_t output_bytes = 0;
+    regexopt_arena arena;
+    double elapsed = 0;
+    while(total.size() < 3 || elapsed < min_time)
+    {
+        arena.Clear();
+        clock::time_point t0 = clock::now();
+
+        unsigned pos = 0;
+        regexopt_choices tree = RegexOptParseOnly(input, pos, arena);
+        clock::time_point t1 = clock::now();
+
+        RegexOptOptimize(tree, arena);
+        clock::time_point t2 = clock::now();
+
+        std::ostringstream out;
+        DumpRegexOptTree(out, tree, arena);
+        clock::time_point t3 = clock::now();
+
+        if(out.str() != expected)
+            throw std::string("Output differs from RegexOptParse in case ") + c.name;
+        output_bytes = out.str().size();
+
+        std::chrono::duration<double, std::milli> p(t1-t0), o(t2-t1), d(t3-t2), t(t3-t0);
+        parse.push_back(p.count());
+        optimize.push_back(o.count());
+        dump.push_back(d.count());
+        total.push_back(t.count());
+        elapsed += t.count() / 1000.0;
+    }
+
+    double t = Median(total);
+    std::cout.setf(std::ios::fixed);
+    std::cout.precision(3);
+    std::cout << "{\"case\":\"" << c.name << "\""
+              << ",\"input_bytes\":"  << input.size()
+              << ",\"output_bytes\":" << output_bytes
+              << ",\"iterations\":"   << total.size()
+              << ",\"parse_ms\":"     << Median(parse)
+              << ",\"optimize_ms\":"  << Median(optimize)
+              << ",\"dump_ms\":"      << Median(dump)
+              << ",\"total_ms\":"     << t
+              << ",\"ops_per_sec\":"  << (t > 0 ? 1000.0 / t : 0.0)
+              << ",\"peak_rss_kb\":"  << PeakRSS()
+              << "}" << std::endl;
+}
+
+} // namespace
+
+int main(int argc, const char* const* argv)
+{
+    double min_time = 1.0;
+    std::vector<const Case*> selected;
+    try {
+        for(int a=1; a<argc; ++a)
+        {
+            const char* arg = argv[a];
+            if(!std::strcmp(arg, "--list"))
+            {
+                for(unsigned c=0; c<NumCases; ++c) std::cout << Cases[c].name << '\n';
+                return 0;
+            }
+            else if(!std::strcmp(arg, "--min-time") && a+1 < argc)
+                min_time = std::atof(argv[++a]);
+            else if(!std::strcmp(arg, "--corpus") && a+1 < argc)
+                CorpusDir = argv[++a];
+            else
+            {
+                unsigned c = 0;
+                while(c < NumCases && std::strcmp(arg, Cases[c].name)) ++c;
+                if(c == NumCases) throw std::string("Unknown case: ") + arg;
+                selected.push_back(&Cases[c]);
+            }
+        }
+        if(selected.empty())
+        {
+            std::cerr << "usage: regex-bench [--min-time <seconds>] [--corpus <dir>] <case>...\n"
+                         "       regex-bench --list\n";
+            return 1;
+        }
+        for(std::size_t a=0; a<selected.size(); ++a)
+            Run(*selected[a], min_time);
+    }
+    catch(const char* s)
+    {
+        std::cerr << "Error: " << s << std::endl;
+        return 1;
+    }
+    catch(const std::string& s)
+    {
+        std::cerr << "Error: " << s << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,196 @@
+#ifndef bqtCharsetHH
+#define bqtCharsetHH
+
+#include <cstddef>
+#include <functional>
+
+/***************
+ *
+ * A set of byte values, as four 64-bit words.
+ *
+ * It has the interface of the std::bitset<256> that it replaces,
+ * but every operation works a word at a time: union, intersection,
+ * complement and comparison are four word operations (which the
+ * compiler turns into two SSE2 or NEON instructions, or one AVX2
+ * instruction where the target has it), and the members are found
+ * by counting trailing zeros instead of testing 256 bits in turn:
+ *
+ *   for(unsigned c = set.first(); c < 256; c = set.next(c)) ...
+ *
+ */
+class regexopt_charset
+{
+public:
+    static const unsigned Words = 4;
+
+    regexopt_charset(): w() { }
+
+    bool operator[] (unsigned c) const { return (w[c >> 6] >> (c & 63)) & 1; }
+    bool test(unsigned c) const        { return (*this)[c]; }
+    std::size_t size() const           { return 256; }
+
+    regexopt_charset& set()
+    {
+        for(unsigned a=0; a<Words; ++a) w[a] = ~0ULL;
+        return *this;
+    }
+    regexopt_charset& set(unsigned c, bool value = true)
+    {
+        if(value) w[c >> 6] |= 1ULL << (c & 63);
+        else      w[c >> 6] &= ~(1ULL << (c & 63));
+        return *this;
+    }
+    regexopt_charset& reset()
+    {
+        for(unsigned a=0; a<Words; ++a) w[a] = 0;
+        return *this;
+    }
+    regexopt_charset& reset(unsigned c) { return set(c, false); }
+    regexopt_charset& flip()
+    {
+        for(unsigned a=0; a<Words; ++a) w[a] = ~w[a];
+        return *this;
+    }
+    regexopt_charset& flip(unsigned c)
+    {
+        w[c >> 6] ^= 1ULL << (c & 63);
+        return *this;
+    }
+
+    unsigned count() const
+    {
+        unsigned n = 0;
+        for(unsigned a=0; a<Words; ++a) n += PopCount(w[a]);
+        return n;
+    }
+    bool any() const { return (w[0] | w[1] | w[2] | w[3]) != 0; }
+    bool none() const { return !any(); }
+    bool all() const { return (w[0] & w[1] & w[2] & w[3]) == ~0ULL; }
+    /* Whether there is exactly one member; cheaper than count() == 1. */
+    bool single() const
+    {
+        unsigned long long v = w[0] | w[1] | w[2] | w[3];
+        unsigned words = (w[0] != 0) + (w[1] != 0) + (w[2] != 0) + (w[3] != 0);
+        return words == 1 && !(v & (v - 1));
+    }
+
+    /* The smallest member, or 256 if there is none. */
+    unsigned first() const { return Scan(0, w[0]); }
+    /* The largest member, or 256 if there is none. */
+    unsigned last() const
+    {
+        for(unsigned a=Words; a-- > 0; )
+            if(w[a]) return a*64 + 63 - LeadingZeros(w[a]);
+        return 256;
+    }
+    /* The smallest member greater than c, or 256 if there is none. */
+    unsigned next(unsigned c) const
+    {
+        if(++c >= 256) return 256;
+        return Scan(c >> 6, w[c >> 6] & (~0ULL << (c & 63)));
+    }
+
+    bool is_subset_of(const regexopt_charset& b) const
+    {
+        unsigned long long extra = 0;
+        for(unsigned a=0; a<Words; ++a) extra |= w[a] & ~b.w[a];
+        return !extra;
+    }
+    bool intersects(const regexopt_charset& b) const
+    {
+        unsigned long long common = 0;
+        for(unsigned a=0; a<Words; ++a) common |= w[a] & b.w[a];
+        return common != 0;
+    }
+
+    regexopt_charset& operator&= (const regexopt_charset& b)
+    {
+        for(unsigned a=0; a<Words; ++a) w[a] &= b.w[a];
+        return *this;
+    }
+    regexopt_charset& operator|= (const regexopt_charset& b)
+    {
+        for(unsigned a=0; a<Words; ++a) w[a] |= b.w[a];
+        return *this;
+    }
+    regexopt_charset& operator^= (const regexopt_charset& b)
+    {
+        for(unsigned a=0; a<Words; ++a) w[a] ^= b.w[a];
+        return *this;
+    }
+    regexopt_charset operator~ () const { regexopt_charset r(*this); return r.flip(); }
+    regexopt_charset operator& (const regexopt_charset& b) const { regexopt_charset r(*this); return r &= b; }
+    regexopt_charset operator| (const regexopt_charset& b) const { regexopt_charset r(*this); return r |= b; }
+    regexopt_charset operator^ (const regexopt_charset& b) const { regexopt_charset r(*this); return r ^= b; }
+
+    bool operator== (const regexopt_charset& b) const
+    {
+        unsigned long long diff = 0;
+        for(unsigned a=0; a<Words; ++a) diff |= w[a] ^ b.w[a];
+        return !diff;
+    }
+    bool operator!= (const regexopt_charset& b) const { return !(*this == b); }
+
+    std::size_t hash() const
+    {
+        unsigned long long h = 0;
+        for(unsigned a=0; a<Words; ++a)
+            h = (h ^ w[a]) * 0x9E3779B97F4A7C15ULL;
+        return (std::size_t)(h ^ (h >> 29));
+    }
+
+private:
+    static unsigned PopCount(unsigned long long v)
+    {
+    #ifdef __GNUC__
+        return __builtin_popcountll(v);
+    #else
+        v = v - ((v >> 1) & 0x5555555555555555ULL);
+        v = (v & 0x3333333333333333ULL) + ((v >> 2) & 0x3333333333333333ULL);
+        v = (v + (v >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+        return (unsigned)((v * 0x0101010101010101ULL) >> 56);
+    #endif
+    }
+    static unsigned TrailingZeros(unsigned long long v) // v != 0
+    {
+    #ifdef __GNUC__
+        return __builtin_ctzll(v);
+    #else
+        unsigned n = 0;
+        while(!(v & 1)) { v >>= 1; ++n; }
+        return n;
+    #endif
+    }
+    static unsigned LeadingZeros(unsigned long long v) // v != 0
+    {
+    #ifdef __GNUC__
+        return __builtin_clzll(v);
+    #else
+        unsigned n = 0;
+        while(!(v >> 63)) { v <<= 1; ++n; }
+        return n;
+    #endif
+    }
+    /* The first member in word a (whose bits are given in v) or after. */
+    unsigned Scan(unsigned a, unsigned long long v) const
+    {
+        for(;;)
+        {
+            if(v) return a*64 + TrailingZeros(v);
+            if(++a == Words) return 256;
+            v = w[a];
+        }
+    }
+
+    unsigned long long w[Words];
+};
+
+namespace std
+{
+    template<> struct hash<regexopt_charset>
+    {
+        std::size_t operator() (const regexopt_charset& s) const { return s.hash(); }
+    };
+}
+
+#endif
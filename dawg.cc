@@ -0,0 +1,259 @@
+#include <algorithm>
+
+#include "dawg.hh"
+
+/* Minimal acyclic automaton builder for regex-opt */
+/* Copyright (C) 1992,2006 Bisqwit (http://iki.fi/bisqwit/) */
+
+std::size_t regexopt_dawg::StateHash::operator() (unsigned n) const
+{
+    const state& s = d->states[n];
+    std::size_t h = s.final ? 0x9E3779B97F4A7C15ULL : 0;
+    for(std::vector<edge>::const_iterator
+        i = s.edges.begin(); i != s.edges.end(); ++i)
+    {
+        h ^= (i->target * 0x100ULL + i->ch) + 0x9E3779B97F4A7C15ULL + (h << 6) + (h >> 2);
+    }
+    return h;
+}
+
+bool regexopt_dawg::StateEqual::operator() (unsigned a, unsigned b) const
+{
+    const state& sa = d->states[a];
+    const state& sb = d->states[b];
+    if(sa.final != sb.final || sa.edges.size() != sb.edges.size()) return false;
+    for(std::size_t e=0; e<sa.edges.size(); ++e)
+        if(sa.edges[e].ch     != sb.edges[e].ch
+        || sa.edges[e].target != sb.edges[e].target) return false;
+    return true;
+}
+
+regexopt_dawg::regexopt_dawg()
+    : states(1), spare(), unchecked(),
+      registry(0, StateHash{this}, StateEqual{this}),
+      prev(), num_words(0), finished(false), next_serial(1)
+{
+    Touch(root());
+}
+
+regexopt_dawg::~regexopt_dawg()
+{
+}
+
+unsigned regexopt_dawg::NewState()
+{
+    if(!spare.empty())
+    {
+        unsigned n = spare.back();
+        spare.pop_back();
+        Touch(n);
+        return n;
+    }
+    states.push_back(state());
+    Touch(states.size() - 1);
+    return states.size() - 1;
+}
+
+void regexopt_dawg::Minimize(std::size_t down_to)
+{
+    /* unchecked[i] is the state after the first i+1 characters
+     * of the previous word. Those deeper than down_to are final
+     * now: replace each by an equivalent registered state, or
+     * register it. Children go first, so that the edges of each
+     * state only point to registered states when it is hashed. */
+    while(unchecked.size() > down_to)
+    {
+        unsigned child  = unchecked.back();
+        unchecked.pop_back();
+        unsigned parent = unchecked.empty() ? root() : unchecked.back();
+
+        std::unordered_set<unsigned, StateHash, StateEqual>::const_iterator
+            i = registry.find(child);
+        if(i != registry.end())
+        {
+            states[parent].edges.back().target = *i;
+            Touch(parent);
+            states[child] = state();
+            spare.push_back(child);
+        }
+        else
+            registry.insert(child);
+    }
+}
+
+void regexopt_dawg::Add(const std::string& word)
+{
+    if(finished) throw "Words may not be added to a finished word list";
+    if(num_words)
+    {
+        if(word == prev) return;
+        if(word < prev)
+            throw std::string("Word list is not sorted: \"") + word
+                + "\" comes after \"" + prev + "\"";
+    }
+
+    std::size_t common = 0, max = std::min(word.size(), prev.size());
+    while(common < max && word[common] == prev[common]) ++common;
+
+    Minimize(common);
+
+    unsigned node = common ? unchecked.back() : root();
+    for(std::size_t a=common; a<word.size(); ++a)
+    {
+        unsigned n = NewState();
+        edge e; e.ch = word[a]; e.target = n;
+        states[node].edges.push_back(e);
+        Touch(node);
+        unchecked.push_back(n);
+        node = n;
+    }
+    states[node].final = true;
+    Touch(node);
+
+    prev = word;
+    ++num_words;
+}
+
+void regexopt_dawg::Finish()
+{
+    Minimize(0);
+    for(std::size_t n=0; n<states.size(); ++n)
+        for(std::size_t e=0; e<states[n].edges.size(); ++e)
+            ++states[states[n].edges[e].target].refs;
+    finished = true;
+}
+
+static const unsigned NoState = ~0U;
+
+unsigned regexopt_dawg::Target(unsigned n, unsigned char ch) const
+{
+    const std::vector<edge>& edges = states[n].edges;
+    for(std::size_t e=0; e<edges.size(); ++e)
+        if(edges[e].ch == ch) return edges[e].target;
+    return NoState;
+}
+
+/* Points the edge for ch to target, adding or (if target
+ * is NoState) removing the edge as needed. */
+void regexopt_dawg::SetTarget(state& s, unsigned char ch, unsigned target)
+{
+    std::vector<edge>::iterator i = s.edges.begin();
+    while(i != s.edges.end() && i->ch < ch) ++i;
+    if(i != s.edges.end() && i->ch == ch)
+    {
+        if(target == NoState) s.edges.erase(i);
+        else i->target = target;
+    }
+    else if(target != NoState)
+    {
+        edge e; e.ch = ch; e.target = target;
+        s.edges.insert(i, e);
+    }
+}
+
+/* Returns the registered state equal to s, adding s if there is none. */
+unsigned regexopt_dawg::Register(const state& s)
+{
+    unsigned n = NewState();
+    states[n].edges = s.edges;
+    states[n].final = s.final;
+
+    std::unordered_set<unsigned, StateHash, StateEqual>::const_iterator
+        i = registry.find(n);
+    if(i != registry.end())
+    {
+        states[n] = state();
+        spare.push_back(n);
+        return *i;
+    }
+    registry.insert(n);
+    for(std::size_t e=0; e<s.edges.size(); ++e)
+        ++states[s.edges[e].target].refs;
+    return n;
+}
+
+/* Drops one reference to n, releasing the states no longer used. */
+void regexopt_dawg::Unref(unsigned n)
+{
+    std::vector<unsigned> pending(1, n);
+    while(!pending.empty())
+    {
+        unsigned m = pending.back();
+        pending.pop_back();
+        if(--states[m].refs) continue;
+
+        registry.erase(m);
+        for(std::size_t e=0; e<states[m].edges.size(); ++e)
+            pending.push_back(states[m].edges[e].target);
+        states[m] = state();
+        spare.push_back(m);
+    }
+}
+
+/* Rebuilds the path of the word from its end up, with the last
+ * state made final or not. path[i] is the existing state after
+ * the first i characters; it may stop short of the whole word. */
+void regexopt_dawg::Rebuild(const std::string& word, const std::vector<unsigned>& path,
+                            bool final)
+{
+    unsigned child = NoState;
+    for(std::size_t a=word.size(); a>0; --a)
+    {
+        state s;
+        if(a < path.size()) { s.edges = states[path[a]].edges; s.final = states[path[a]].final; }
+        if(a == word.size())
+            s.final = final;
+        else
+            SetTarget(s, word[a], child);
+        child = (s.edges.empty() && !s.final) ? NoState : Register(s);
+    }
+
+    if(word.empty())
+        states[root()].final = final;
+    else
+    {
+        unsigned old = Target(root(), word[0]);
+        SetTarget(states[root()], word[0], child);
+        if(child != NoState) ++states[child].refs;
+        if(old != NoState) Unref(old);
+    }
+    Touch(root());
+}
+
+bool regexopt_dawg::Contains(const std::string& word) const
+{
+    unsigned n = root();
+    for(std::size_t a=0; a<word.size(); ++a)
+        if((n = Target(n, word[a])) == NoState) return false;
+    return states[n].final;
+}
+
+bool regexopt_dawg::Insert(const std::string& word)
+{
+    if(!finished) throw "Insert() requires a finished word list";
+    if(Contains(word)) return false;
+
+    std::vector<unsigned> path(1, root());
+    for(std::size_t a=0; a<word.size(); ++a)
+    {
+        unsigned n = Target(path.back(), word[a]);
+        if(n == NoState) break;
+        path.push_back(n);
+    }
+    Rebuild(word, path, true);
+    ++num_words;
+    return true;
+}
+
+bool regexopt_dawg::Erase(const std::string& word)
+{
+    if(!finished) throw "Erase() requires a finished word list";
+    if(!Contains(word)) return false;
+
+    std::vector<unsigned> path(1, root());
+    for(std::size_t a=0; a<word.size(); ++a)
+        path.push_back(Target(path.back(), word[a]));
+    Rebuild(word, path, false);
+    --num_words;
+    return true;
+}
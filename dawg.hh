@@ -0,0 +1,111 @@
+#ifndef bqtDawgHH
+#define bqtDawgHH
+
+#include <string>
+#include <vector>
+#include <unordered_set>
+#include <cstddef>
+
+/***************
+ *
+ * Minimal acyclic automaton (a "DAWG") accepting a set of
+ * byte strings. Words are added in lexicographic order, and
+ * the automaton is kept minimal while it is being built:
+ * as soon as a word diverges from the previous one, the
+ * previous word's suffix can no longer grow, so its states
+ * are merged with any equivalent states registered earlier.
+ * (Daciuk, Mihov, Watson & Watson, 2000.)
+ *
+ * Building takes time linear in the total length of the words.
+ *
+ * Once finished, the automaton can also be changed one word at
+ * a time, in any order: only the states on the path of the word
+ * are rebuilt (and shared with equivalent ones), so it stays
+ * minimal. States other than the root are never modified after
+ * that; a state number may be reused once its state is no longer
+ * needed, but then with a new serial number.
+ */
+class regexopt_dawg
+{
+public:
+    struct edge
+    {
+        unsigned char ch;
+        unsigned target;
+    };
+    struct state
+    {
+        std::vector<edge> edges; // sorted by ch
+        bool final;
+        unsigned refs;             // number of edges leading here, once finished
+        unsigned long long serial; // changes whenever the state does
+
+        state(): edges(), final(false), refs(0), serial(0) { }
+    };
+
+    regexopt_dawg();
+    ~regexopt_dawg();
+
+    /* Adds a word. Words must come in strictly increasing
+     * std::string order; duplicates of the previous word are
+     * ignored, anything smaller throws. */
+    void Add(const std::string& word);
+
+    /* Minimizes the path of the last word. Must be called after
+     * the last Add(). Further Add()s are not allowed afterwards. */
+    void Finish();
+
+    /* Adding and removing single words in a finished automaton,
+     * in time proportional to the length of the word. They return
+     * false if the word was already there / was not there. */
+    bool Insert(const std::string& word);
+    bool Erase(const std::string& word);
+    bool Contains(const std::string& word) const;
+
+    unsigned root() const { return 0; }
+    const state& operator[] (unsigned n) const { return states[n]; }
+
+    /* Upper bound of the state numbers. Not all of them are in use. */
+    unsigned limit() const { return states.size(); }
+
+    /* Number of states reachable from the root. */
+    std::size_t size() const { return states.size() - spare.size(); }
+    std::size_t words() const { return num_words; }
+
+private:
+    struct StateHash
+    {
+        const regexopt_dawg* d;
+        std::size_t operator() (unsigned n) const;
+    };
+    struct StateEqual
+    {
+        const regexopt_dawg* d;
+        bool operator() (unsigned a, unsigned b) const;
+    };
+
+    std::vector<state> states;
+    std::vector<unsigned> spare;     // recyclable state numbers
+    std::vector<unsigned> unchecked; // path of the previous word
+    std::unordered_set<unsigned, StateHash, StateEqual> registry;
+    std::string prev;
+    std::size_t num_words;
+    bool finished;
+    unsigned long long next_serial;
+
+    void Minimize(std::size_t down_to);
+    unsigned NewState();
+    void Touch(unsigned n) { states[n].serial = next_serial++; }
+
+    unsigned Target(unsigned n, unsigned char ch) const;
+    static void SetTarget(state& s, unsigned char ch, unsigned target);
+    unsigned Register(const state& s);
+    void Unref(unsigned n);
+    void Rebuild(const std::string& word, const std::vector<unsigned>& path,
+                 bool final);
+
+    regexopt_dawg(const regexopt_dawg&);
+    void operator= (const regexopt_dawg&);
+};
+
+#endif
@@ -0,0 +1,417 @@
+#include <string>
+#include <vector>
+#include <set>
+#include <unordered_map>
+#include <unordered_set>
+#include <algorithm>
+#include <iterator>
+
+#include "dfa.hh"
+
+/* Automaton compiler for regex-opt */
+/* Copyright (C) 1992,2006 Bisqwit (http://iki.fi/bisqwit/) */
+
+typedef regexopt_charset charset;
+typedef regexopt_sequence sequence;
+typedef regexopt_choices choices;
+typedef regexopt_item item;
+
+static const unsigned uinf = ~0U;
+
+namespace {
+
+/* Thompson's construction: every fragment has one entry and
+ * one exit, and each state has at most one byte transition. */
+struct NfaState
+{
+    const charset* set; // 0 if the state has only empty transitions
+    unsigned next;      // target of the byte transition
+    std::vector<unsigned> empty;
+};
+
+class NfaBuilder
+{
+public:
+    struct Fragment
+    {
+        unsigned begin, end;
+    };
+
+    NfaBuilder(const regexopt_arena& a, std::vector<NfaState>& s, unsigned l)
+        : arena(a), states(s), limit(l)
+    {
+    }
+
+    Fragment Tree(const choices& c)
+    {
+        Fragment f = { New(), New() };
+        if(c.empty()) Link(f.begin, f.end); // printed as (?:), so it matches ""
+        for(choices::const_iterator i = c.begin(); i != c.end(); ++i)
+        {
+            Fragment alt = Sequence(*i);
+            Link(f.begin, alt.begin);
+            Link(alt.end, f.end);
+        }
+        return f;
+    }
+
+private:
+    const regexopt_arena& arena;
+    std::vector<NfaState>& states;
+    const unsigned limit;
+
+    unsigned New()
+    {
+        if(states.size() >= limit)
+            throw std::string("Regexp too large to compile: the NFA has too many states");
+        NfaState s = { 0, 0, std::vector<unsigned>() };
+        states.push_back(s);
+        return states.size() - 1;
+    }
+    void Link(unsigned from, unsigned to) { states[from].empty.push_back(to); }
+
+    Fragment Sequence(const sequence& seq)
+    {
+        Fragment f;
+        f.begin = f.end = New();
+        for(sequence::const_iterator i = seq.begin(); i != seq.end(); ++i)
+        {
+            Fragment it = Item(*i);
+            Link(f.end, it.begin);
+            f.end = it.end;
+        }
+        return f;
+    }
+
+    Fragment Atom(const item& it)
+    {
+        if(it.tree) return Tree(*it.tree);
+        Fragment f = { New(), New() };
+        states[f.begin].set  = &arena.charset(it.ch);
+        states[f.begin].next = f.end;
+        return f;
+    }
+
+    /* x{n,m} is written out as n copies of x followed
+     * by m-n optional ones, x{n,} as n copies and x*. */
+    Fragment Item(const item& it)
+    {
+        Fragment f;
+        f.begin = New();
+        unsigned cur = f.begin;
+        for(unsigned n=0; n<it.min; ++n)
+        {
+            Fragment a = Atom(it);
+            Link(cur, a.begin);
+            cur = a.end;
+        }
+        if(it.max == uinf)
+        {
+            unsigned loop = New();
+            Fragment a = Atom(it);
+            Link(cur, loop);
+            Link(loop, a.begin);
+            Link(a.end, loop);
+            f.end = loop;
+            return f;
+        }
+        f.end = New();
+        for(unsigned n=it.min; n<it.max; ++n)
+        {
+            Fragment a = Atom(it);
+            Link(cur, f.end);
+            Link(cur, a.begin);
+            cur = a.end;
+        }
+        Link(cur, f.end);
+        return f;
+    }
+};
+
+/* Collects the charsets used in the tree. */
+static void CollectCharsets(const choices& tree, std::set<unsigned>& ids)
+{
+    std::set<const choices*> seen;
+    std::vector<const choices*> pending(1, &tree);
+    while(!pending.empty())
+    {
+        const choices* c = pending.back();
+        pending.pop_back();
+        if(!seen.insert(c).second) continue;
+        for(choices::const_iterator i = c->begin(); i != c->end(); ++i)
+            for(sequence::const_iterator j = i->begin(); j != i->end(); ++j)
+            {
+                if(j->tree) pending.push_back(j->tree);
+                else ids.insert(j->ch);
+            }
+    }
+}
+
+class Closure
+{
+public:
+    explicit Closure(const std::vector<NfaState>& n)
+        : nfa(n), mark(n.size(), 0), generation(0), pending()
+    {
+    }
+
+    /* Adds the states reachable through empty transitions,
+     * except the given ones, and sorts the set. */
+    void operator() (std::vector<unsigned>& set, const std::vector<bool>& except)
+    {
+        ++generation;
+        pending.swap(set);
+        set.clear();
+        while(!pending.empty())
+        {
+            unsigned s = pending.back();
+            pending.pop_back();
+            if(mark[s] == generation || except[s]) continue;
+            mark[s] = generation;
+            set.push_back(s);
+            const std::vector<unsigned>& e = nfa[s].empty;
+            pending.insert(pending.end(), e.begin(), e.end());
+        }
+        std::sort(set.begin(), set.end());
+    }
+
+private:
+    const std::vector<NfaState>& nfa;
+    std::vector<unsigned> mark;
+    unsigned generation;
+    std::vector<unsigned> pending;
+};
+
+/* The states that the set moves to on each byte class, unclosed. */
+static void Move(const std::vector<unsigned>& set,
+                 const std::vector<std::vector<unsigned> >& taken,
+                 const std::vector<NfaState>& nfa,
+                 std::vector<std::vector<unsigned> >& moves)
+{
+    for(std::size_t c=0; c<moves.size(); ++c) moves[c].clear();
+    for(std::size_t a=0; a<set.size(); ++a)
+    {
+        const std::vector<unsigned>& classes = taken[set[a]];
+        for(std::size_t c=0; c<classes.size(); ++c)
+            moves[classes[c]].push_back(nfa[set[a]].next);
+    }
+}
+
+struct VectorHash
+{
+    std::size_t operator() (const std::vector<unsigned>& v) const
+    {
+        std::size_t h = v.size();
+        for(std::size_t a=0; a<v.size(); ++a)
+            h ^= v[a] + 0x9E3779B97F4A7C15ULL + (h << 6) + (h >> 2);
+        return h;
+    }
+};
+
+} // namespace
+
+regexopt_dfa::regexopt_dfa(const regexopt_choices& tree, const regexopt_arena& arena,
+                           const regexopt_dfa_options& options)
+    : table(), start(0), last_special(0), num_states(0), num_classes(0),
+      is_anchored(options.anchored)
+{
+    /* Byte classes: split the bytes by each charset in turn,
+     * numbering the classes in the order of their first byte. */
+    std::set<unsigned> ids;
+    CollectCharsets(tree, ids);
+    std::vector<unsigned> cls(256, 0);
+    std::vector<unsigned> split; // [class * 2 + bit] -> new class
+    num_classes = 1;
+    for(std::set<unsigned>::const_iterator i = ids.begin(); i != ids.end(); ++i)
+    {
+        const charset& set = arena.charset(*i);
+        split.assign(num_classes * 2, uinf);
+        unsigned count = 0;
+        for(unsigned b=0; b<256; ++b)
+        {
+            unsigned& j = split[cls[b] * 2 + set.test(b)];
+            if(j == uinf) j = count++;
+            cls[b] = j;
+        }
+        num_classes = count;
+    }
+    std::vector<unsigned> representative(num_classes, uinf);
+    for(unsigned b=256; b-- > 0; )
+    {
+        byte_class[b] = cls[b];
+        representative[cls[b]] = b;
+    }
+
+    std::vector<NfaState> nfa;
+    NfaBuilder::Fragment whole = NfaBuilder(arena, nfa, options.max_nfa_states).Tree(tree);
+
+    /* The byte classes that each byte transition is taken on. */
+    std::vector<std::vector<unsigned> > taken(nfa.size());
+    for(unsigned n=0; n<nfa.size(); ++n)
+        if(nfa[n].set)
+            for(unsigned c=0; c<num_classes; ++c)
+                if(nfa[n].set->test(representative[c]))
+                    taken[n].push_back(c);
+
+    /* The subset construction. Sets are sorted vectors of NFA states,
+     * closed under the empty transitions. Set 0 is the dead state.
+     *
+     * Unanchored, every set includes the closure of the start state,
+     * so that a match may begin anywhere. Those states are left out of
+     * the sets ("implicit"), or each set would carry all of them, and
+     * the sets they move to on each class are added to every move. */
+    Closure close(nfa);
+    std::vector<bool> implicit(nfa.size(), false);
+    std::vector<std::vector<unsigned> > moves(num_classes), start_moves(num_classes);
+
+    std::vector<unsigned> initial(1, whole.begin);
+    close(initial, implicit);
+    if(!is_anchored)
+    {
+        for(std::size_t a=0; a<initial.size(); ++a) implicit[initial[a]] = true;
+        Move(initial, taken, nfa, start_moves);
+        for(unsigned c=0; c<num_classes; ++c) close(start_moves[c], implicit);
+        initial.clear();
+    }
+
+    std::vector<std::vector<unsigned> > sets;
+    std::unordered_map<std::vector<unsigned>, unsigned, VectorHash> numbers;
+    std::vector<unsigned> next; // [set * num_classes + class] -> set
+
+    sets.push_back(std::vector<unsigned>());
+    if(is_anchored) numbers[sets[0]] = 0;
+    numbers[initial] = 1;
+    sets.push_back(initial);
+
+    std::vector<unsigned> target;
+    for(unsigned s=0; s<sets.size(); ++s)
+    {
+        if(s == 0)
+        {
+            next.resize(num_classes, 0);
+            continue;
+        }
+        Move(sets[s], taken, nfa, moves);
+        for(unsigned c=0; c<num_classes; ++c)
+        {
+            close(moves[c], implicit);
+            if(!is_anchored && !start_moves[c].empty())
+            {
+                target.clear();
+                std::set_union(moves[c].begin(), moves[c].end(),
+                               start_moves[c].begin(), start_moves[c].end(),
+                               std::back_inserter(target));
+                moves[c].swap(target);
+            }
+
+            std::unordered_map<std::vector<unsigned>, unsigned, VectorHash>::iterator
+                i = numbers.find(moves[c]);
+            if(i == numbers.end())
+            {
+                if(sets.size() >= options.max_states)
+                    throw std::string("Regexp too large to compile: the DFA has too many states");
+                i = numbers.insert(std::make_pair(moves[c], (unsigned)sets.size())).first;
+                sets.push_back(moves[c]);
+            }
+            next.push_back(i->second);
+        }
+    }
+    num_states = sets.size();
+
+    /* Renumber: the dead state, then the accepting ones, then the rest. */
+    std::vector<unsigned> order(num_states);
+    unsigned n = 0;
+    order[0] = n++;
+    std::vector<bool> accepting(num_states, implicit[whole.end]);
+    for(unsigned s=1; s<num_states; ++s)
+        if(std::binary_search(sets[s].begin(), sets[s].end(), whole.end)) accepting[s] = true;
+    for(unsigned s=1; s<num_states; ++s)
+        if(accepting[s]) order[s] = n++;
+    last_special = (n-1) * num_classes;
+    for(unsigned s=1; s<num_states; ++s)
+        if(!accepting[s]) order[s] = n++;
+
+    table.resize(num_states * num_classes);
+    for(unsigned s=0; s<num_states; ++s)
+        for(unsigned c=0; c<num_classes; ++c)
+            table[order[s] * num_classes + c] = order[next[s * num_classes + c]] * num_classes;
+    start = order[1] * num_classes;
+}
+
+regexopt_dfa::~regexopt_dfa()
+{
+}
+
+std::size_t regexopt_dfa::Find(const void* data, std::size_t length) const
+{
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    const unsigned* t = &table[0];
+    const unsigned special = last_special;
+
+    unsigned s = start;
+    if(s <= special) return s ? 0 : npos;
+    for(std::size_t a=0; a<length; ++a)
+    {
+        s = t[s + byte_class[p[a]]];
+        if(s <= special) return s ? a+1 : npos;
+    }
+    return npos;
+}
+
+bool regexopt_dfa::Match(const void* data, std::size_t length) const
+{
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    const unsigned* t = &table[0];
+
+    unsigned s = start;
+    for(std::size_t a=0; a<length && s; ++a)
+        s = t[s + byte_class[p[a]]];
+    return Accepting(s);
+}
+
+bool regexopt_dfa::Differ(const regexopt_dfa& a, const regexopt_dfa& b, bool one_way)
+{
+    /* The pairs of classes that some byte is in. */
+    std::vector<std::pair<unsigned, unsigned> > columns;
+    std::vector<bool> seen(a.num_classes * b.num_classes);
+    for(unsigned byte=0; byte<256; ++byte)
+    {
+        unsigned ca = a.byte_class[byte], cb = b.byte_class[byte];
+        if(seen[ca * b.num_classes + cb]) continue;
+        seen[ca * b.num_classes + cb] = true;
+        columns.push_back(std::make_pair(ca, cb));
+    }
+
+    /* Walk the product automaton, looking for a pair of
+     * states of which only one accepts (or only a does). */
+    std::unordered_set<unsigned long long> visited;
+    std::vector<std::pair<unsigned, unsigned> > pending;
+    pending.push_back(std::make_pair(a.start, b.start));
+    visited.insert((unsigned long long)a.start << 32 | b.start);
+    while(!pending.empty())
+    {
+        unsigned sa = pending.back().first, sb = pending.back().second;
+        pending.pop_back();
+        if(a.Accepting(sa) != b.Accepting(sb)
+        && (!one_way || a.Accepting(sa))) return true;
+
+        for(std::size_t c=0; c<columns.size(); ++c)
+        {
+            unsigned ta = a.table[sa + columns[c].first];
+            unsigned tb = b.table[sb + columns[c].second];
+            if(visited.insert((unsigned long long)ta << 32 | tb).second)
+                pending.push_back(std::make_pair(ta, tb));
+        }
+    }
+    return false;
+}
+
+bool RegexOptEquivalent(const regexopt_dfa& a, const regexopt_dfa& b)
+{
+    return !regexopt_dfa::Differ(a, b, false);
+}
+
+bool RegexOptIncluded(const regexopt_dfa& a, const regexopt_dfa& b)
+{
+    return !regexopt_dfa::Differ(a, b, true);
+}
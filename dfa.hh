@@ -0,0 +1,86 @@
+#ifndef bqtDfaHH
+#define bqtDfaHH
+
+#include <vector>
+#include <cstddef>
+#include "libregex.hh"
+
+/***************
+ *
+ * Deterministic automaton compiled from a tree, for matching
+ * byte strings and for comparing the languages of two trees.
+ *
+ * The bytes are divided into classes that no charset of the tree
+ * tells apart, and the transition table has one column per class.
+ * State numbers in the table are premultiplied by the number of
+ * classes, so one step of the scan is one lookup and one add. The
+ * dead state and the accepting states are numbered first, so one
+ * comparison per byte tells whether the scan must stop.
+ *
+ * The automaton is built by the subset construction, which may
+ * take exponential space; the limits make it throw a std::string
+ * instead. Greediness does not matter for what is accepted, so
+ * it is ignored. Possessive items are compiled as if greedy, which
+ * is only right where RegexOptGuardBacktracking made them so.
+ */
+struct regexopt_dfa_options
+{
+    /* Whether a match must begin at the start of the input.
+     * Otherwise the automaton looks for one anywhere. */
+    bool anchored;
+
+    unsigned max_states;     // states of the automaton
+    unsigned max_nfa_states; // states of the NFA it is built from, after
+                             // writing out the counted repeats
+
+    regexopt_dfa_options(): anchored(false), max_states(10000), max_nfa_states(1000000) { }
+};
+
+class regexopt_dfa
+{
+public:
+    regexopt_dfa(const regexopt_choices& tree, const regexopt_arena& arena,
+                 const regexopt_dfa_options& options = regexopt_dfa_options());
+    ~regexopt_dfa();
+
+    static const std::size_t npos = ~(std::size_t)0;
+
+    /* Returns the end of the first match (the offset just past its
+     * last byte), or npos if there is none. An empty match at the
+     * start gives 0. */
+    std::size_t Find(const void* data, std::size_t length) const;
+
+    /* Whether the input ends in a match: if anchored, whether the
+     * whole input matches; otherwise whether any suffix of it does. */
+    bool Match(const void* data, std::size_t length) const;
+
+    unsigned states() const { return num_states; }
+    unsigned classes() const { return num_classes; }
+    bool anchored() const { return is_anchored; }
+
+    /* Whether the two automata accept the same strings. To check
+     * that a rewrite keeps the language, compare anchored ones. */
+    friend bool RegexOptEquivalent(const regexopt_dfa& a, const regexopt_dfa& b);
+    /* Whether b accepts every string that a accepts. */
+    friend bool RegexOptIncluded(const regexopt_dfa& a, const regexopt_dfa& b);
+
+private:
+    unsigned char byte_class[256];
+    std::vector<unsigned> table; // [state + class] -> state, both premultiplied
+    unsigned start;              // premultiplied
+    unsigned last_special;       // premultiplied; states <= this are dead (0) or accepting
+    unsigned num_states;
+    unsigned num_classes;
+    bool is_anchored;
+
+    bool Accepting(unsigned s) const { return s && s <= last_special; }
+
+    /* Looks for a string that a accepts and b does not (or, unless
+     * one_way, that b accepts and a does not). */
+    static bool Differ(const regexopt_dfa& a, const regexopt_dfa& b, bool one_way);
+};
+
+bool RegexOptEquivalent(const regexopt_dfa& a, const regexopt_dfa& b);
+bool RegexOptIncluded(const regexopt_dfa& a, const regexopt_dfa& b);
+
+#endif
@@ -0,0 +1,78 @@
+#ifndef bqtIncrementalHH
+#define bqtIncrementalHH
+
+#include <string>
+#include <map>
+#include <cstddef>
+#include "libregex.hh"
+#include "dawg.hh"
+
+/***************
+ *
+ * An optimized alternation of literal words and regexps that is
+ * kept up to date as they are added and removed, for lists that
+ * change a few entries at a time.
+ *
+ * The words are kept in a minimal automaton (see dawg.hh) that is
+ * updated in place. When converting it into a tree, the expansion
+ * of each state is remembered, and only the states on the paths of
+ * the changed words are expanded again. Each regexp is optimized
+ * once, when it is added. The results are frozen: the optimizer
+ * does not descend into them again, but only combines them with
+ * the changed parts.
+ *
+ * The result is always the same as what Rebuild() produces from
+ * scratch: the alternation of RegexOptWordList() of the words and
+ * RegexOptParse() of each regexp (in sorted order), optimized.
+ * Without regexps, it is the RegexOptWordList() of the words.
+ */
+class regexopt_incremental
+{
+public:
+    explicit regexopt_incremental(const regexopt_options& options = regexopt_options());
+    ~regexopt_incremental();
+
+    /* Return false if the word was already there / was not there. */
+    bool AddWord(const std::string& word);
+    bool RemoveWord(const std::string& word);
+
+    /* Return false if the regexp was already there / was not there.
+     * AddRegex throws like RegexOptParse if it does not parse. */
+    bool AddRegex(const std::string& regex);
+    bool RemoveRegex(const std::string& regex);
+
+    std::size_t words() const { return dawg.words(); }
+    std::size_t regexps() const { return parsed.size(); }
+
+    /* The optimized alternation. Its nodes belong to arena(), and
+     * it stays valid until the next change. */
+    const regexopt_choices& Result();
+    const regexopt_arena& arena() const { return nodes; }
+
+    /* Forgets all the remembered work and builds the result anew.
+     * Also done now and then by Result() to free the memory held
+     * by nodes that are no longer used. */
+    void Rebuild();
+
+private:
+    struct state_cache;
+
+    regexopt_options options;
+    regexopt_dawg dawg;
+    regexopt_arena nodes;
+    std::map<std::string, regexopt_choices> parsed; // subtrees frozen
+    state_cache* cache;
+
+    regexopt_choices result;
+    bool stale;       // result must be recomputed
+    bool damaged;     // a budget ran out, so the remembered work is partial
+    std::size_t base; // nodes in the arena after the last rebuild
+
+    void Compute();
+    void Parse(const std::string& regex, regexopt_choices& tree);
+
+    regexopt_incremental(const regexopt_incremental&);
+    void operator= (const regexopt_incremental&);
+};
+
+#endif
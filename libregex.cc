@@ -1,10 +1,26 @@
 #include <string>
-#include <bitset>
+#include <cstring>
 #include <cctype>
 #include <algorithm>
 #include <iostream>
+#include <new>
+#include <functional>
+#include <unordered_map>
+#include <unordered_set>
+#include <sstream>
+#include <iomanip>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <exception>
 
 #include "libregex.hh"
+#include "dawg.hh"
+#include "dfa.hh"
+#include "incremental.hh"
 
 /* Extended regular expression optimizer */
 /* Copyright (C) 1992,2006 Bisqwit (http://iki.fi/bisqwit/) */
@@ -18,22 +34,318 @@ typedef regexopt_item item;
 
 #include "rangeset.hh"
 
-template<std::size_t N>
-static unsigned FindFirst(const std::bitset<N>& set)
+/* The blocks of the arena grow geometrically up to this many nodes. */
+static const std::size_t ArenaFirstBlock = 64;
+static const std::size_t ArenaMaxBlock   = 8192;
+
+struct regexopt_arena::block
+{
+    block* next;
+    std::size_t capacity;
+    std::size_t used;
+
+    choices* slots() { return reinterpret_cast<choices*>(this+1); }
+};
+
+regexopt_arena::regexopt_arena()
+    : blocks(0), num_nodes(0), num_reserved(0),
+      charsets(), singles(), charset_ids(), unions(), intersections()
+{
+    Intern(regexopt_charset());
+}
+
+regexopt_arena::~regexopt_arena()
+{
+    Release(0);
+}
+
+void* regexopt_arena::Allocate()
+{
+    if(!blocks || blocks->used == blocks->capacity)
+    {
+        std::size_t capacity = blocks ? std::min(blocks->capacity*2, ArenaMaxBlock)
+                                      : ArenaFirstBlock;
+        std::size_t size = sizeof(block) + capacity * sizeof(choices);
+        block* b = static_cast<block*>(::operator new(size));
+        b->next     = blocks;
+        b->capacity = capacity;
+        b->used     = 0;
+        blocks = b;
+        num_reserved += size;
+    }
+    return blocks->slots() + blocks->used;
+}
+
+/* The slot is only claimed after the node was successfully
+ * constructed, so that Release() never destroys garbage. */
+choices* regexopt_arena::NewChoices()
+{
+    choices* p = new(Allocate()) choices;
+    ++blocks->used; ++num_nodes;
+    return p;
+}
+
+choices* regexopt_arena::NewChoices(const choices& src)
+{
+    choices* p = new(Allocate()) choices(src);
+    ++blocks->used; ++num_nodes;
+    return p;
+}
+
+void regexopt_arena::Release(block* keep)
+{
+    for(block* next, *b = blocks; b; b = next)
+    {
+        next = b->next;
+        for(std::size_t a=0; a<b->used; ++a)
+            b->slots()[a].~choices();
+        b->used = 0;
+        if(b == keep) { b->next = 0; continue; }
+        num_reserved -= sizeof(block) + b->capacity * sizeof(choices);
+        ::operator delete(b);
+    }
+    blocks    = keep;
+    num_nodes = 0;
+}
+
+void regexopt_arena::Clear()
+{
+    // The newest block is the largest one.
+    Release(blocks);
+
+    charsets.clear();
+    singles.clear();
+    charset_ids.clear();
+    unions.clear();
+    intersections.clear();
+    Intern(regexopt_charset());
+}
+
+unsigned regexopt_arena::Intern(const regexopt_charset& set)
+{
+    std::pair<std::unordered_map<regexopt_charset, unsigned>::iterator, bool>
+        r = charset_ids.insert(std::make_pair(set, (unsigned)charsets.size()));
+    if(r.second)
+    {
+        charsets.push_back(set);
+        singles.push_back(set.single());
+    }
+    return r.first->second;
+}
+
+unsigned regexopt_arena::CharsetUnion(unsigned a, unsigned b)
+{
+    if(a == b || !b) return a;
+    if(!a) return b;
+    if(a > b) std::swap(a, b);
+    unsigned long long key = (unsigned long long)a << 32 | b;
+    memo::iterator i = unions.find(key);
+    if(i != unions.end()) return i->second;
+    unsigned result = Intern(charsets[a] | charsets[b]);
+    unions.insert(std::make_pair(key, result));
+    return result;
+}
+
+unsigned regexopt_arena::CharsetIntersection(unsigned a, unsigned b)
+{
+    if(a == b || !a) return a;
+    if(!b) return b;
+    if(a > b) std::swap(a, b);
+    unsigned long long key = (unsigned long long)a << 32 | b;
+    memo::iterator i = intersections.find(key);
+    if(i != intersections.end()) return i->second;
+    unsigned result = Intern(charsets[a] & charsets[b]);
+    intersections.insert(std::make_pair(key, result));
+    return result;
+}
+
+void regexopt_arena::Fork(regexopt_arena& child) const
+{
+    child.charsets    = charsets;
+    child.singles     = singles;
+    child.charset_ids = charset_ids;
+}
+
+void regexopt_arena::Adopt(regexopt_arena& child, std::vector<unsigned>& ids)
+{
+    /* The charsets that the fork had from here keep their ids. */
+    ids.resize(child.charsets.size());
+    for(std::size_t a=0; a<child.charsets.size(); ++a)
+        ids[a] = a < charsets.size() && charsets[a] == child.charsets[a]
+               ? a : Intern(child.charsets[a]);
+
+    for(block* b = child.blocks; b; b = b->next)
+        for(std::size_t a=0; a<b->used; ++a)
+            b->slots()[a].RemapCharsets(ids);
+
+    /* Keep allocating from the newest block here. */
+    if(child.blocks)
+    {
+        block* last = child.blocks;
+        while(last->next) last = last->next;
+        if(blocks)
+        {
+            last->next   = blocks->next;
+            blocks->next = child.blocks;
+        }
+        else
+            blocks = child.blocks;
+    }
+    num_nodes    += child.num_nodes;
+    num_reserved += child.num_reserved;
+    child.blocks       = 0;
+    child.num_nodes    = 0;
+    child.num_reserved = 0;
+}
+
+/* How much of a tree SubsumeTree has compared already:
+ * nothing, only its literal alternatives, or all of them. */
+enum SubsumeChecked { checked_none, checked_literals, checked_all };
+
+/* State of the RegexOptParse call running on this thread:
+ * the arena that receives the nodes, the options, whether
+ * Parse() optimizes as it goes, the representative nodes
+ * when subtrees are interned, the pairs of alternatives that
+ * SubsumeTree need not compare again (or how much of the tree
+ * about to be optimized has been compared already), and what
+ * is left of the budget. */
+#ifdef REGEXOPT_STATS
+class PassTimer;
+#endif
+struct ParseContext
+{
+    regexopt_arena* arena;
+    const regexopt_options* options;
+    bool optimize;
+    std::unordered_multimap<std::size_t, choices*> interned;
+    std::unordered_set<std::size_t> unsubsumed; // see SubsumeTree
+    SubsumeChecked combined_checked; // see CombineGroups
+#ifdef REGEXOPT_STATS
+    PassTimer* pass; // innermost pass being timed
+#endif
+
+    unsigned long long steps_left; // ignored if step_limit is 0
+    std::chrono::steady_clock::time_point deadline; // ignored if time_limit is 0
+    bool exhausted;
+};
+static thread_local ParseContext* Current = 0;
+
+struct ContextScope
+{
+    ParseContext context;
+    ParseContext* prev;
+
+    ContextScope(regexopt_arena& a, const regexopt_options& o): prev(Current)
+    {
+        context.arena    = &a;
+        context.options  = &o;
+        context.optimize = true;
+        context.combined_checked = checked_none;
+#ifdef REGEXOPT_STATS
+        context.pass     = 0;
+#endif
+        context.steps_left = o.step_limit;
+        context.exhausted  = false;
+        if(o.time_limit > 0)
+            context.deadline = std::chrono::steady_clock::now()
+                + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                    std::chrono::duration<double>(o.time_limit));
+        Current = &context;
+    }
+    ~ContextScope()
+    {
+        if(context.options->partial) *context.options->partial = context.exhausted;
+        Current = prev;
+    }
+};
+
+/* Takes one step from the budget. Returns false when it has run
+ * out; the caller must then stop rewriting, leaving its tree valid. */
+static bool Step()
+{
+    ParseContext& c = *Current;
+    if(c.exhausted) return false;
+    const regexopt_options& o = *c.options;
+    if(o.step_limit && !c.steps_left--)
+        c.exhausted = true;
+    else if(o.time_limit > 0 && std::chrono::steady_clock::now() >= c.deadline)
+        c.exhausted = true;
+    return !c.exhausted;
+}
+
+#ifdef REGEXOPT_STATS
+/* Counts a call of the pass and times it for as long as it is
+ * in scope. The time spent in nested passes is subtracted. */
+class PassTimer
 {
-    #ifdef _GLIBCXX_BITSET
-    return set._Find_first();
-    #endif
-    for(unsigned p=0; p<N; ++p)
-        if(set.test(p))
-            return p;
-    return N;
+public:
+    explicit PassTimer(regexopt_stats::pass p): counters(0), parent(0), start(), nested(0)
+    {
+        regexopt_stats* stats = Current->options->stats;
+        if(!stats) return;
+        counters = &stats->passes[p];
+        ++counters->calls;
+        parent = Current->pass;
+        Current->pass = this;
+        start = clock::now();
+    }
+    ~PassTimer();
+
+private:
+    typedef std::chrono::steady_clock clock;
+    regexopt_stats::counters* counters;
+    PassTimer* parent;
+    clock::time_point start;
+    double nested; // seconds spent in the passes called from this one
+
+    PassTimer(const PassTimer&);
+    void operator= (const PassTimer&);
+};
+PassTimer::~PassTimer()
+{
+    if(!counters) return;
+    double elapsed = std::chrono::duration<double>(clock::now() - start).count();
+    counters->seconds += elapsed - nested;
+    if(parent) parent->nested += elapsed;
+    Current->pass = parent;
+}
+
+# define STATS_PASS(p) PassTimer pass_timer(regexopt_stats::p)
+# define STATS_ADD(p, field, n) \
+    do { if(regexopt_stats* s_ = Current->options->stats) \
+             s_->passes[regexopt_stats::p].field += (n); } while(0)
+#else
+# define STATS_PASS(p)          do { } while(0)
+# define STATS_ADD(p, field, n) do { } while(0)
+#endif
+
+static choices* NewChoices()
+{
+    return Current->arena->NewChoices();
+}
+static choices* NewChoices(const choices& src)
+{
+    return Current->arena->NewChoices(src);
+}
+static unsigned InternCharset(const charset& set)
+{
+    return Current->arena->Intern(set);
+}
+
+/* Equal subtrees are usually the very same node when they are
+ * interned, and unequal ones usually have different hashes,
+ * so the full walk is only needed to confirm a match. */
+static bool EqualTrees(const choices& a, const choices& b)
+{
+    if(&a == &b) return true;
+    if(a.size() != b.size() || a.hash() != b.hash()) return false;
+    return std::equal(a.begin(), a.end(), b.begin());
 }
 
 bool regexopt_item::is_equal(const regexopt_item& b) const
 {
-    if(greedy != b.greedy) return false;
-    if(tree) return b.tree && *tree == *b.tree;
+    if(greedy != b.greedy || possessive != b.possessive) return false;
+    if(tree) return b.tree && EqualTrees(*tree, *b.tree);
     if(b.tree) return false;
     return ch == b.ch;
 }
@@ -43,17 +355,176 @@ bool regexopt_item::operator==(const regexopt_item& b) const
     if(!tree != !b.tree
     || min != b.min
     || max != b.max
-    || greedy != b.greedy) return false;
-    if(tree) { return *tree == *b.tree; }
+    || greedy != b.greedy
+    || possessive != b.possessive) return false;
+    if(tree) { return EqualTrees(*tree, *b.tree); }
     return ch == b.ch;
 }
 
 
+static void HashCombine(std::size_t& h, std::size_t v)
+{
+    h ^= v + 0x9E3779B97F4A7C15ULL + (h << 6) + (h >> 2);
+}
+
+/* Structural hash: items that are equal by operator==
+ * also have equal hashes. */
+std::size_t regexopt_item::hash() const
+{
+    std::size_t h = tree ? tree->hash() : ch;
+    HashCombine(h, min);
+    HashCombine(h, max);
+    HashCombine(h, greedy);
+    if(possessive) HashCombine(h, possessive);
+    return h;
+}
+
+regexopt_choices::regexopt_choices()
+    : slots(), live(0), hash_value(0), hash_valid(false), is_frozen(false),
+      is_optimized(false)
+{
+}
+
+/* Copies only the live alternatives. */
+regexopt_choices::regexopt_choices(const regexopt_choices& b)
+    : slots(), live(b.live), hash_value(b.hash_value), hash_valid(b.hash_valid),
+      is_frozen(false), is_optimized(b.is_optimized)
+{
+    slots.reserve(b.live);
+    for(const_iterator i = b.begin(); i != b.end(); ++i)
+    {
+        slot s = { *i, false };
+        slots.push_back(s);
+    }
+}
+
+regexopt_choices::regexopt_choices(regexopt_choices&& b)
+    : slots(), live(0), hash_value(0), hash_valid(false), is_frozen(false),
+      is_optimized(false)
+{
+    swap(b);
+}
+
+regexopt_choices::~regexopt_choices()
+{
+}
+
+regexopt_choices& regexopt_choices::operator= (regexopt_choices b)
+{
+    swap(b);
+    return *this;
+}
+
+void regexopt_choices::swap(regexopt_choices& b)
+{
+    slots.swap(b.slots);
+    std::swap(live,       b.live);
+    std::swap(hash_value, b.hash_value);
+    std::swap(hash_valid, b.hash_valid);
+    std::swap(is_frozen,  b.is_frozen);
+    std::swap(is_optimized, b.is_optimized);
+}
+
+void regexopt_choices::push_back(const sequence& seq)
+{
+    slot s = { seq, false };
+    slots.push_back(s);
+    ++live;
+    is_frozen = false;
+    is_optimized = false;
+}
+
+void regexopt_choices::push_back(sequence&& seq)
+{
+    slots.push_back(slot());
+    slots.back().seq.swap(seq);
+    slots.back().dead = false;
+    ++live;
+    is_frozen = false;
+    is_optimized = false;
+}
+
+void regexopt_choices::erase(iterator i)
+{
+    slot& s = slots[i.index];
+    sequence().swap(s.seq);
+    s.dead = true;
+    --live;
+    is_frozen = false;
+    is_optimized = false;
+}
+
+void regexopt_choices::clear()
+{
+    slots.clear();
+    live = 0;
+    is_frozen = false;
+    is_optimized = false;
+}
+
+void regexopt_choices::Compact()
+{
+    if(live == slots.size()) return;
+    std::size_t w = 0;
+    for(std::size_t r = 0; r < slots.size(); ++r)
+        if(!slots[r].dead)
+        {
+            if(w != r) slots[w].seq.swap(slots[r].seq);
+            slots[w++].dead = false;
+        }
+    slots.resize(w);
+}
+
+void regexopt_choices::RemapCharsets(const std::vector<unsigned>& ids)
+{
+    for(iterator i = begin(); i != end(); ++i)
+        for(sequence::iterator j = i->begin(); j != i->end(); ++j)
+            if(!j->tree) j->ch = ids[j->ch];
+    hash_valid = false; // the hash is made of the ids
+}
+
+std::size_t regexopt_choices::hash() const
+{
+    if(hash_valid) return hash_value;
+
+    std::size_t h = size();
+    for(const_iterator i = begin(); i != end(); ++i)
+    {
+        std::size_t hs = i->size();
+        for(sequence::const_iterator j = i->begin(); j != i->end(); ++j)
+            HashCombine(hs, j->hash());
+        HashCombine(h, hs);
+    }
+    hash_value = h;
+    hash_valid = true;
+    return h;
+}
+
+/* Replaces the subtree by an earlier node having the same
+ * structure, or makes it the representative of its kind. */
+static choices* InternTree(choices* tree)
+{
+    std::unordered_multimap<std::size_t, choices*>& table = Current->interned;
+    std::size_t h = tree->hash();
+    auto range = table.equal_range(h);
+    for(auto i = range.first; i != range.second; ++i)
+        if(i->second == tree || EqualTrees(*i->second, *tree))
+            return i->second;
+    table.insert(std::make_pair(h, tree));
+    return tree;
+}
+
+
 enum ParensFlag { no_parens=false, yes_parens=true, automatic=2 };
 
-static void DumpTree(std::ostream&, const choices& c, ParensFlag need_parens=automatic);
-static void DumpSequence(std::ostream&, const sequence& s);
-static void DumpKey(std::ostream&, const charset& s);
+/* Where each item went in the output: offsets of its first and
+ * past its last character. A shared subtree is recorded where
+ * it is printed first. */
+typedef std::unordered_map<const item*, std::pair<std::size_t, std::size_t> > ItemPositions;
+
+static void DumpTree(std::ostream&, const choices& c, const regexopt_arena& arena,
+                     const regexopt_emitter& syntax,
+                     ParensFlag need_parens=automatic, ItemPositions* where=0);
 
 static void OptimizeSequence(sequence& seq);
 static void OptimizeTree(choices& tree);
@@ -101,18 +572,145 @@ static const sequence CopySequenceFromBegin(const sequence& a, unsigned n)
     result.insert(result.end(), a.begin(), a.begin() + std::min(n, (unsigned)a.size()));
     return result;
 }
-static void RemoveSequenceFromBegin(sequence& a, unsigned n)
+
+/* Cost estimates for regexopt_options::cost_model. */
+struct Estimate
+{
+    regexopt_cost_features f;
+    double pass; // probability that the part matches
+};
+
+static const std::string& KeyText(const charset& s);
+static Estimate EstimateTree(const choices& tree);
+
+static unsigned Digits(unsigned n)
+{
+    unsigned d = 1;
+    while(n >= 10) { n /= 10; ++d; }
+    return d;
+}
+
+/* The sum of no alternatives; see AddAlternative. */
+static Estimate NoAlternatives()
+{
+    Estimate e = { { 0, 0, 0, 0, 0 }, 0 };
+    return e;
+}
+
+/* Adds an alternative to a list of them. Each costs one
+ * branch and, when printed, one '|'. */
+static void AddAlternative(Estimate& sum, const Estimate& e)
+{
+    sum.f.length     += e.f.length + 1;
+    sum.f.tests      += e.f.tests;
+    sum.f.branches   += e.f.branches + 1;
+    sum.f.nesting    += e.f.nesting;
+    sum.f.selectivity = std::min(1.0, sum.f.selectivity + e.f.selectivity);
+    sum.pass          = std::min(1.0, sum.pass + e.pass);
+}
+
+static Estimate EstimateItem(const item& it)
+{
+    Estimate e;
+    if(it.tree)
+        e = EstimateTree(*it.tree);
+    else
+    {
+        const charset& set = Current->arena->charset(it.ch);
+        e.f.length   = KeyText(set).size();
+        e.f.tests    = 1;
+        e.f.branches = 0;
+        e.f.nesting  = 0;
+        e.f.selectivity = e.pass = set.count() / 256.0;
+    }
+    if(it.min == 1 && it.max == 1)
+    {
+        if(it.tree && it.tree->size() != 1) e.f.length += 4; // (?:)
+        return e;
+    }
+
+    /* The length as DumpSequence prints it. */
+    bool suffix = !it.greedy || it.possessive; // ? or +
+    if(it.tree) e.f.length += 4;
+    if(it.max == uinf)
+        e.f.length += it.min < 2 ? 1 : Digits(it.min) + 3;
+    else if(it.min == 0 && it.max == 1)
+        e.f.length += 1;
+    else if(it.min != it.max)
+        e.f.length += Digits(it.min) + Digits(it.max) + 3;
+    else if(it.min < 3 && !it.tree && Current->arena->charset(it.ch).count() == 1)
+    {
+        e.f.length *= it.min;
+        suffix = false;
+    }
+    else
+        e.f.length += Digits(it.min) + 2;
+    if(suffix) e.f.length += 1;
+
+    /* Each iteration is tried if the ones before it matched.
+     * Past the first few, they make little difference. */
+    double tried = 0, p = 1, through = 1;
+    for(unsigned k=0; k<it.max && k<16; ++k)
+    {
+        tried += p;
+        p *= e.pass;
+        if(k < it.min) through = p;
+    }
+    e.f.tests   *= tried;
+    e.f.branches *= tried;
+    e.f.nesting  = (e.f.nesting + (it.tree ? 1 : 0)) * tried;
+    e.pass = through;
+    return e;
+}
+
+/* The items are tried in order, each only if the ones before it
+ * matched. The first byte may be that of any item up to the first
+ * one that cannot be skipped. */
+static Estimate EstimateSequence(const item* begin, const item* end)
+{
+    Estimate e = { { 0, 0, 0, 0, 1 }, 1 };
+    while(end != begin)
+    {
+        const item& it = *--end;
+        const Estimate i = EstimateItem(it);
+        e.f.length  += i.f.length;
+        e.f.tests    = i.f.tests    + i.pass * e.f.tests;
+        e.f.branches = i.f.branches + i.pass * e.f.branches;
+        e.f.nesting  = i.f.nesting  + i.pass * e.f.nesting;
+        e.f.selectivity = it.min ? i.f.selectivity
+                                 : std::min(1.0, i.f.selectivity + e.f.selectivity);
+        e.pass *= i.pass;
+    }
+    return e;
+}
+static Estimate EstimateSequence(sequence::const_iterator begin, sequence::const_iterator end)
+{
+    return begin == end ? EstimateSequence(0, 0) : EstimateSequence(&*begin, &*begin + (end-begin));
+}
+
+static Estimate EstimateTree(const choices& tree)
 {
-    a.erase(a.begin(), a.begin() + std::min((unsigned)a.size(), n));
+    Estimate e = NoAlternatives();
+    for(choices::const_iterator i=tree.begin(); i!=tree.end(); ++i)
+        AddAlternative(e, EstimateSequence(i->begin(), i->end()));
+    /* No '|' after the last one, and no branching if there is one. */
+    if(!tree.empty()) e.f.length -= 1;
+    if(tree.size() == 1) e.f.branches -= 1;
+    return e;
 }
-static void RemoveSequenceFromEnd(sequence& a, unsigned n)
+
+/* Whether a rewrite from before to after is allowed by the cost model. */
+static bool Affordable(const Estimate& before, const Estimate& after)
 {
-    a.erase(a.end() - std::min(n, (unsigned)a.size()), a.end());
+    const regexopt_cost_model& model = *Current->options->cost_model;
+    return model.Cost(after.f) <= model.Cost(before.f);
 }
 
 static void CompressSequence(sequence& seq)
 {
     if(seq.empty()) return;
+    STATS_PASS(compress_sequence);
+    STATS_ADD(compress_sequence, nodes, seq.size());
 
     // Convert ab{0}c to ac
     // Convert aaaa to a{4}
@@ -142,6 +740,7 @@ static void CompressSequence(sequence& seq)
     if(erased || !seq[0].max)
     {
         if(seq[prev].max != 0) result.push_back(seq[prev]);
+        STATS_ADD(compress_sequence, rewrites, seq.size() - result.size());
         seq = result;
     }
 }
@@ -155,7 +754,7 @@ static void DeleteEmptyNodesInSequence(sequence& seq)
 
         /* Delete empty nodes like ()? or []+ */
         if((it.tree  && it.tree->empty())
-        || (!it.tree && !it.ch.any()))
+        || (!it.tree && !it.ch))
         {
             seq.erase(seq.begin()+a);
             if(a >= seq.size())break;
@@ -164,24 +763,35 @@ static void DeleteEmptyNodesInSequence(sequence& seq)
     }
 }
 
-static void HeavyCompressSequence(sequence& seq)
+/* A tandem repeat: seq[begin .. begin+len*count) consists of
+ * count consecutive copies of seq[begin .. begin+len). */
+struct Repeat
 {
-    // Convert "abababcd" to "(ab){3}cd"
-restart:
-    for(unsigned a=0; a<seq.size(); ++a)
+    unsigned begin, len, count;
+};
+
+static unsigned RepeatWindow(unsigned maxlen)
+{
+    unsigned window = Current->options->repeat_window;
+    return (window && window < maxlen) ? window : maxlen;
+}
+
+/* The straightforward search: at each position, try every
+ * period and count the copies. O(n^2) comparisons at worst
+ * for each position, but fast enough for short sequences. */
+static bool FindFirstRepeatSlow(const sequence& seq, Repeat& result, unsigned from)
+{
+    for(unsigned a=from; a<seq.size(); ++a)
     {
         unsigned left = seq.size() - a;
-        unsigned maxlen = left / 2;
+        unsigned maxlen = RepeatWindow(left / 2);
 
         unsigned bestscore = 0;
-        unsigned bestscore_len   = 0;
-        unsigned bestscore_count = 0;
-
         for(unsigned m=1; m<=maxlen; ++m)
         {
             unsigned maxcount = left / m;
             unsigned score = m;
-            for(unsigned c=1; c<=maxcount; ++c)
+            for(unsigned c=1; c<maxcount; ++c)
             {
                 bool eq = equal(seq.begin()+a,
                                 seq.begin()+a+m,
@@ -192,32 +802,259 @@ restart:
                 if(score > bestscore)
                 {
                     bestscore = score;
-                    bestscore_len   = m;
-                    bestscore_count = c+1;
+                    result.begin = a;
+                    result.len   = m;
+                    result.count = c+1;
                 }
             }
         }
-        if(bestscore)
+        if(bestscore) return true;
+    }
+    return false;
+}
+
+/* Finds the repeats for HeavyCompressSequence, and keeps its
+ * tables up to date as the repeats are rewritten.
+ *
+ * Items are numbered so that equal items get equal numbers, and
+ * polynomial hashes of all prefixes of the numbers, modulo the
+ * Mersenne prime 2^61-1, let any two subsequences be compared in
+ * constant time. For each period p, every run of length >= 2p with
+ * that period contains one of the positions 0, p, 2p, ...; from each
+ * such position the run is extended both ways over the hashes.
+ *
+ * No repeat starts before the place of the previous rewrite, unless
+ * it covers the new item. So the scan for period p starts 2p items
+ * before it, and stops once it is past the best start found so far.
+ */
+class RepeatFinder
+{
+public:
+    explicit RepeatFinder(sequence& s)
+        : seq(s), indexed(s.size() >= MinIndexed),
+          ids(), prefix(), power(), numbers(), samples(), unchanged(0)
+    {
+        if(!indexed) return;
+        ids.resize(seq.size());
+        prefix.resize(seq.size()+1);
+        power.resize(seq.size()+1);
+        power[0] = 1;
+        for(unsigned a=0; a<seq.size(); ++a)
         {
-            sequence subseq;
-            subseq.insert(subseq.end(), seq.begin()+a, seq.begin()+a+bestscore_len);
+            ids[a] = Number(seq[a]);
+            power[a+1] = MulMod(power[a], Base);
+        }
+        prefix[0] = 0;
+        Rehash(0);
+    }
+    ~RepeatFinder();
 
-            choices* tmp = new choices;
-            tmp->push_back(subseq);
-            item it;
-            it.tree = tmp;
-            it.min = it.max = bestscore_count;
-            it.Optimize();
-            seq[a] = it;
-            seq.erase(seq.begin()+a+1, seq.begin()+a+bestscore_len*bestscore_count);
-            goto restart;
+    /* Finds the same repeat as FindFirstRepeatSlow: the first
+     * one that begins at or after "from". */
+    bool Find(Repeat& result, unsigned from)
+    {
+        const unsigned n = seq.size();
+        if(!indexed || n < MinIndexed) return FindFirstRepeatSlow(seq, result, from);
+
+        const unsigned maxlen = RepeatWindow(n / 2);
+        unsigned bestbegin = n, bestscore = 0;
+        for(unsigned p=1; p<=maxlen; ++p)
+        {
+            unsigned q = unchanged > 2*p ? (unchanged - 2*p) / p * p : 0;
+            q = std::max(q, (from + p-1) / p * p);
+            /* A run first met at q begins after q-p. */
+            for(; q+p < n && q < bestbegin+p; )
+            {
+                /* seq[j] == seq[j+p] for all j in [q-back, q+fwd). */
+                if(ids[q] != ids[q+p]) { q += p; continue; }
+                unsigned fwd  = Forward(q, q+p, n-q-p);
+                unsigned back = Backward(q, q+p, q - from);
+                if(back + fwd >= p)
+                {
+                    unsigned begin = q - back;
+                    unsigned count = (back + fwd + p) / p;
+                    if(begin < bestbegin || (begin == bestbegin && p*count > bestscore))
+                    {
+                        bestbegin = begin;
+                        bestscore = p*count;
+                        result.begin = begin;
+                        result.len   = p;
+                        result.count = count;
+                    }
+                    break; // the other runs of this period begin later
+                }
+                q += (fwd/p + 1) * p;
+            }
+        }
+        if(bestbegin == n) return false;
+
+        /* Hash collisions could only make runs look longer than they
+         * are. Check the winner exactly, and if it is off, do it slowly. */
+        const unsigned a = result.begin, m = result.len, c = result.count;
+        for(unsigned k=1; k<c; ++k)
+            if(!equal(seq.begin()+a, seq.begin()+a+m, seq.begin()+a+m*k))
+                return FindFirstRepeatSlow(seq, result, from);
+        if(a + m*(c+1) <= n && equal(seq.begin()+a, seq.begin()+a+m, seq.begin()+a+m*c))
+            return FindFirstRepeatSlow(seq, result, from);
+        return true;
+    }
+
+    /* Replaces the repeat by the given item. */
+    void Replace(const Repeat& r, const item& it)
+    {
+        seq[r.begin] = it;
+        seq.erase(seq.begin()+r.begin+1, seq.begin()+r.begin+r.len*r.count);
+        if(!indexed) return;
+
+        ids[r.begin] = Number(it);
+        ids.erase(ids.begin()+r.begin+1, ids.begin()+r.begin+r.len*r.count);
+        prefix.resize(seq.size()+1);
+        Rehash(r.begin);
+        unchanged = r.begin;
+    }
+
+private:
+    typedef unsigned long long u64;
+    static const u64 Mod  = (1ULL << 61) - 1;
+    static const u64 Base = 0x1F3D5B79ULL;
+    /* Shorter sequences are left for FindFirstRepeatSlow. */
+    static const unsigned MinIndexed = 16;
+
+    sequence& seq;
+    bool indexed;
+    std::vector<unsigned> ids;
+    std::vector<u64> prefix, power;
+    std::unordered_multimap<std::size_t, unsigned> numbers; // item hash -> id
+    std::vector<item> samples;                              // id -> item
+    unsigned unchanged;
+
+    unsigned Number(const item& it)
+    {
+        std::size_t h = it.hash();
+        auto range = numbers.equal_range(h);
+        for(auto i = range.first; i != range.second; ++i)
+            if(samples[i->second] == it) return i->second;
+        unsigned id = samples.size();
+        numbers.insert(std::make_pair(h, id));
+        samples.push_back(it);
+        return id;
+    }
+
+    void Rehash(unsigned from)
+    {
+        for(unsigned a=from; a<ids.size(); ++a)
+            prefix[a+1] = Add(MulMod(prefix[a], Base), ids[a]+1);
+    }
+
+    /* True if seq[a .. a+n) and seq[b .. b+n) are (almost surely) equal. */
+    bool Equal(unsigned a, unsigned b, unsigned n) const
+    {
+        return Get(a, n) == Get(b, n);
+    }
+
+    /* Length of the longest common extension of a and b forwards,
+     * not going past limit. Most are short, so the first few items
+     * are compared directly before resorting to a binary search. */
+    unsigned Forward(unsigned a, unsigned b, unsigned limit) const
+    {
+        unsigned lo = 0;
+        for(; lo < limit && lo < 8; ++lo)
+            if(ids[a+lo] != ids[b+lo]) return lo;
+        unsigned hi = limit;
+        while(lo < hi)
+        {
+            unsigned mid = lo + (hi-lo+1)/2;
+            if(Equal(a, b, mid)) lo = mid; else hi = mid-1;
+        }
+        return lo;
+    }
+    /* Same backwards: the largest n <= limit such that
+     * seq[a-n .. a) equals seq[b-n .. b). */
+    unsigned Backward(unsigned a, unsigned b, unsigned limit) const
+    {
+        unsigned lo = 0;
+        for(; lo < limit && lo < 8; ++lo)
+            if(ids[a-1-lo] != ids[b-1-lo]) return lo;
+        unsigned hi = limit;
+        while(lo < hi)
+        {
+            unsigned mid = lo + (hi-lo+1)/2;
+            if(Equal(a-mid, b-mid, mid)) lo = mid; else hi = mid-1;
+        }
+        return lo;
+    }
+
+    static u64 Add(u64 a, u64 b)
+    {
+        u64 r = a + b;
+        return r >= Mod ? r - Mod : r;
+    }
+    static u64 MulMod(u64 a, u64 b)
+    {
+        /* Both operands are below 2^61. Split them into
+         * 32-bit halves and fold the products by 2^61 == 1. */
+        u64 al = a & 0xFFFFFFFFULL, ah = a >> 32;
+        u64 bl = b & 0xFFFFFFFFULL, bh = b >> 32;
+        u64 lo  = al * bl;             // < 2^64
+        u64 mid = al * bh + ah * bl;   // < 2^62
+        u64 hi  = ah * bh;             // < 2^58
+        /* value = hi*2^64 + mid*2^32 + lo */
+        u64 r = (lo & Mod) + (lo >> 61)
+              + ((mid & ((1ULL << 29) - 1)) << 32) + (mid >> 29)
+              + (hi << 3);
+        r = (r & Mod) + (r >> 61);
+        return r >= Mod ? r - Mod : r;
+    }
+    u64 Get(unsigned a, unsigned n) const
+    {
+        return Add(prefix[a+n], Mod - MulMod(prefix[a], power[n]));
+    }
+
+    RepeatFinder(const RepeatFinder&);
+    void operator= (const RepeatFinder&);
+};
+
+RepeatFinder::~RepeatFinder()
+{
+}
+
+static void HeavyCompressSequence(sequence& seq)
+{
+    // Convert "abababcd" to "(ab){3}cd"
+    if(Current->exhausted) return;
+    STATS_PASS(heavy_compress_sequence);
+    STATS_ADD(heavy_compress_sequence, nodes, seq.size());
+    RepeatFinder finder(seq);
+    Repeat r;
+    unsigned from = 0; // repeats found before this were turned down
+    while(finder.Find(r, from) && Step())
+    {
+        STATS_ADD(heavy_compress_sequence, iterations, 1);
+        sequence subseq(seq.begin()+r.begin, seq.begin()+r.begin+r.len);
+
+        choices* tmp = NewChoices();
+        tmp->push_back(subseq);
+        item it;
+        it.tree = tmp;
+        it.min = it.max = r.count;
+        it.Optimize();
+        if(Current->options->cost_model
+        && !Affordable(EstimateSequence(seq.begin()+r.begin, seq.begin()+r.begin+r.len*r.count),
+                       EstimateSequence(&it, &it+1)))
+        {
+            from = r.begin+1;
+            continue;
         }
+        STATS_ADD(heavy_compress_sequence, rewrites, 1);
+        finder.Replace(r, it);
     }
 }
 static void FlattenSequence(sequence& seq)
 {
     // Convert a(bc) to abc
 
+    STATS_PASS(flatten_sequence);
+    STATS_ADD(flatten_sequence, nodes, seq.size());
     sequence result;
     result.reserve(seq.size());
 
@@ -230,16 +1067,23 @@ static void FlattenSequence(sequence& seq)
         {
             sequence& seq2 = *seq[a].tree->begin();
 
-            OptimizeSequence(seq2);
+            if(!seq[a].tree->frozen() && !seq[a].tree->optimized())
+            {
+                OptimizeSequence(seq2);
+                seq[a].tree->Changed();
+            }
 
             result.insert(result.end(), seq2.begin(), seq2.end());
+            STATS_ADD(flatten_sequence, rewrites, 1);
         }
         else if(seq[a].max > 0
              && ((seq[a].tree && seq[a].tree->size() > 0)
-              || (!seq[a].tree && seq[a].ch.any())))
+              || (!seq[a].tree && seq[a].ch)))
         {
             result.push_back(seq[a]);
         }
+        else
+            STATS_ADD(flatten_sequence, rewrites, 1);
     }
     seq = result;
 }
@@ -257,33 +1101,52 @@ static void OptimizeSequence(sequence& seq)
     */
 }
 
-static void FlattenTree(choices& tree)
+/* Returns whether groups were flattened. */
+static bool FlattenTree(choices& tree)
 {
     // Convert ((x|y)|z) to (x|y|z)  or ((abc)) to (abc)
 
-    for(choices::iterator j,i=tree.begin(); i!=tree.end(); i=j)
+    struct local
     {
-        j=i; ++j;
-
-        const sequence& seq = *i;
-        if(seq.size() != 1) continue;
-
-        const item& it = seq[0];
-
-        if(it.tree && it.min == 1 && it.max == 1)
+        static bool IsGroup(const sequence& seq)
         {
-            tree.insert(j, it.tree->begin(), it.tree->end());
-            tree.erase(i);
+            return seq.size() == 1 && seq[0].tree
+                && seq[0].min == 1 && seq[0].max == 1;
         }
+    };
+    STATS_PASS(flatten_tree);
+    STATS_ADD(flatten_tree, nodes, tree.size());
+    choices::iterator i = tree.begin();
+    while(i != tree.end() && !local::IsGroup(*i)) ++i;
+    if(i == tree.end()) return false;
+
+    /* The alternatives are stored contiguously, so
+     * the list is rebuilt rather than spliced. */
+    choices result;
+    for(choices::iterator j=tree.begin(); j!=tree.end(); ++j)
+    {
+        if(!local::IsGroup(*j))
+            { result.push_back(std::move(*j)); continue; }
+
+        const choices& sub = *(*j)[0].tree;
+        for(choices::const_iterator k=sub.begin(); k!=sub.end(); ++k)
+            result.push_back(*k);
+        STATS_ADD(flatten_tree, rewrites, 1);
     }
+    tree.swap(result);
+    return true;
 }
 
-static void CharsetCombineTree(choices& tree)
+/* Returns whether alternatives were merged. */
+static bool CharsetCombineTree(choices& tree)
 {
     // Convert (a|d) to ([ad])
 
-    charset ch;
+    STATS_PASS(charset_combine_tree);
+    STATS_ADD(charset_combine_tree, nodes, tree.size());
+    unsigned ch = 0;
 
+    unsigned num_sets = 0;
     bool found_sets = false;
     for(choices::iterator j,i=tree.begin(); i!=tree.end(); i=j)
     {
@@ -304,10 +1167,13 @@ static void CharsetCombineTree(choices& tree)
             continue;
         }
 
-        ch |= it.ch;
+        ch = Current->arena->CharsetUnion(ch, it.ch);
         found_sets = true;
+        ++num_sets;
         tree.erase(i);
     }
+    if(num_sets > 1)
+        STATS_ADD(charset_combine_tree, rewrites, num_sets - 1);
     if(found_sets)
     {
         item tmp;
@@ -330,80 +1196,163 @@ static void CharsetCombineTree(choices& tree)
         // we need a rangeset with possibility of open ends
     }
 */
+    return num_sets > 1;
 }
 
-static bool CountingCombineTree(choices& tree)
+/* The counts of the alternatives that CountingCombineTree merges
+ * seldom make more than a few ranges, so they are kept in place
+ * rather than in a std::map that allocates on every change. */
+typedef rangeset<unsigned, flat_ranges<8> > countranges;
+
+/* Whether the rewrite that CountingCombineTree makes for the
+ * given group of alternatives, with the given ranges of counts,
+ * does not raise the cost. It keeps one alternative for each range
+ * that swallows some of them, and the empty ones unless a range
+ * from zero does. */
+static bool CountingCombineAffordable(const std::vector<choices::iterator>& group,
+                                      unsigned empties, const countranges& ranges)
 {
-    bool did_changes = false;
-
-    /* For each choice, create a map of how many alternatives
-     * there are for the first item.
-     */
-redo_combine:
-    for(choices::iterator i=tree.begin(); i!=tree.end(); ++i)
+    Estimate before = NoAlternatives(), after = NoAlternatives();
+    const Estimate empty = EstimateSequence(0, 0);
+    for(unsigned k=0; k<empties; ++k) AddAlternative(before, empty);
+    for(unsigned k=0; k<group.size(); ++k)
+        AddAlternative(before, EstimateSequence(group[k]->begin(), group[k]->end()));
+
+    bool keep_empties = true;
+    for(countranges::const_iterator
+        ri = ranges.begin(); ri != ranges.end(); ++ri)
     {
-        if(i->size() != 1) continue;
-        const item& i_ref = *i->begin();
+        unsigned r_min = ri->lower;
+        unsigned r_max = ri->upper; if(r_max != uinf) --r_max;
+
+        unsigned k = 0;
+        while(k < group.size() && !(group[k]->front().min >= r_min
+                                 && group[k]->front().max <= r_max)) ++k;
+        if(k == group.size()) continue;
+
+        item it = group[k]->front();
+        it.min = r_min;
+        it.max = r_max;
+        AddAlternative(after, EstimateSequence(&it, &it+1));
+        if(r_min == 0) keep_empties = false;
+    }
+    if(keep_empties)
+        for(unsigned k=0; k<empties; ++k) AddAlternative(after, empty);
 
-        rangeset<unsigned> ranges;
+    return Affordable(before, after);
+}
 
-        /* In rangeset, the "upper" is exclusive.
-         * In choice, the "max" is inclusive.
-         * Therefore, convert.
-         */
-        unsigned i_max = i_ref.max; if(i_max != uinf) ++i_max;
-        ranges.set(i_ref.min, i_max);
+/* Structural hash of an item, leaving out its count. */
+static std::size_t CountlessHash(const item& it)
+{
+    std::size_t h = it.tree ? it.tree->hash() : it.ch;
+    HashCombine(h, it.greedy);
+    if(it.possessive) HashCombine(h, it.possessive);
+    return h;
+}
 
-        for(choices::iterator j=tree.begin(); j!=tree.end(); ++j)
-        {
-            if(j->empty())
-            {
-                // If the sequence is empty, it is acceptable to
-                // interpret it as a 0-size sequence of anything
-                ranges.set(0,1);
-                continue;
-            }
-            if(i == j || j->size() != 1) continue;
-            const item& j_ref = *j->begin();
+/* Merges the alternatives that are one and the same item with
+ * different counts: (a|aa{2}|a{4,}) -> (a{1,2}|a{4,}).
+ *
+ * The alternatives are bucketed once by the hash of their item
+ * without the count, and the groups are merged one after another.
+ * The groups only interact through the empty alternatives, which
+ * count as zero repeats of any item: the group whose range from
+ * zero takes them in removes them, and the groups before it are
+ * then looked at again without them, as a restart would.
+ */
+static bool CountingCombineTree(choices& tree)
+{
+    STATS_PASS(counting_combine_tree);
+    bool did_changes = false;
 
-            if(!i_ref.is_equal(j_ref)) continue;
+    typedef std::vector<choices::iterator> Group;
+    std::vector<Group> groups;
+    std::unordered_multimap<std::size_t, unsigned> buckets;
+    Group empties;
+
+    tree.Compact();
+    for(choices::iterator i=tree.begin(); i!=tree.end(); ++i)
+    {
+        if(i->empty()) { empties.push_back(i); continue; }
+        if(i->size() != 1) continue;
 
-            unsigned j_max = j_ref.max; if(j_max != uinf) ++j_max;
-            ranges.set(j_ref.min, j_max);
+        const item& i_ref = i->front();
+        std::size_t key = CountlessHash(i_ref);
+        std::pair<std::unordered_multimap<std::size_t, unsigned>::iterator,
+                  std::unordered_multimap<std::size_t, unsigned>::iterator>
+            range = buckets.equal_range(key);
+        unsigned g = groups.size();
+        for(; range.first != range.second; ++range.first)
+            if(groups[range.first->second][0]->front().is_equal(i_ref))
+                { g = range.first->second; break; }
+        if(g == groups.size())
+        {
+            groups.push_back(Group());
+            buckets.insert(std::make_pair(key, g));
         }
+        groups[g].push_back(i);
+    }
 
-        /* For each of the combined ranges, find each element
-         * that belongs to this particular group. */
+    for(bool again = true; again; )
+    {
+        again = false;
+        unsigned empties_gone = groups.size(); // the group that took them
 
-        bool changed = false;
-        for(rangeset<unsigned>::const_iterator
-            ri = ranges.begin(); ri != ranges.end(); ++ri)
+        STATS_ADD(counting_combine_tree, iterations, 1);
+        STATS_ADD(counting_combine_tree, nodes, tree.size());
+        for(unsigned g=0; g<groups.size(); ++g)
         {
-            unsigned r_min = ri->lower;
-            unsigned r_max = ri->upper; if(r_max != uinf) --r_max;
+            Group& group = groups[g];
+
+            countranges ranges;
 
-            bool first = true;
-            bool found_something = false;
-            for(choices::iterator jnext,j=tree.begin(); j!=tree.end(); j=jnext)
+            /* In rangeset, the "upper" is exclusive.
+             * In choice, the "max" is inclusive.
+             * Therefore, convert.
+             */
+            for(unsigned k=0; k<group.size(); ++k)
             {
-                jnext=j; ++jnext;
+                const item& j_ref = group[k]->front();
+                unsigned j_max = j_ref.max; if(j_max != uinf) ++j_max;
+                ranges.set(j_ref.min, j_max);
+            }
+            // If the sequence is empty, it is acceptable to
+            // interpret it as a 0-size sequence of anything
+            if(!empties.empty()) ranges.set(0,1);
 
-                if(j->size() != 1)continue;
+            if(Current->options->cost_model
+            && !CountingCombineAffordable(group, empties.size(), ranges))
+                continue;
 
-                item& j_ref = *j->begin();
-                if(!i_ref.is_equal(j_ref)) continue;
+            /* For each of the combined ranges, find each element
+             * that belongs to this particular group. The first one
+             * in each range (which is the first in the tree, too)
+             * stays and the rest are erased. */
 
-                /* If this item is entirely swallowed by
-                 * this particular range, assimilate it
-                 */
+            bool changed = false;
+            Group kept;
+            for(countranges::const_iterator
+                ri = ranges.begin(); ri != ranges.end(); ++ri)
+            {
+                unsigned r_min = ri->lower;
+                unsigned r_max = ri->upper; if(r_max != uinf) --r_max;
 
-                if(j_ref.min >= r_min && j_ref.max <= r_max)
+                bool first = true;
+                for(unsigned k=0; k<group.size(); ++k)
                 {
-                    found_something = true;
+                    if(group[k] == tree.end()) continue; // erased already
+                    item& j_ref = group[k]->front();
+
+                    /* If this item is entirely swallowed by
+                     * this particular range, assimilate it
+                     */
+                    if(j_ref.min < r_min || j_ref.max > r_max) continue;
 
                     if(first)
                     {
                         first = false;
+                        kept.push_back(group[k]);
                         if(j_ref.min == r_min
                         && j_ref.max == r_max) { continue; /* nothing changed */ }
 
@@ -411,37 +1360,177 @@ redo_combine:
                         j_ref.min = r_min;
                         j_ref.max = r_max;
                         changed = true;
+                        STATS_ADD(counting_combine_tree, rewrites, 1);
                     }
                     else
                     {
                         /* Delete this item and set changed-flag */
                         changed = true;
-                        tree.erase(j);
+                        tree.erase(group[k]);
+                        group[k] = tree.end();
+                        STATS_ADD(counting_combine_tree, rewrites, 1);
                     }
                 }
-            }
 
-            if(r_min == 0 && found_something)
-            {
-                // Then we may delete zero-length sequences
-                for(choices::iterator jnext,j=tree.begin(); j!=tree.end(); j=jnext)
+                if(r_min == 0 && !first && !empties.empty())
                 {
-                    jnext=j; ++jnext;
-                    if(j->empty()) tree.erase(j);
+                    // Then we may delete zero-length sequences
+                    for(unsigned k=0; k<empties.size(); ++k)
+                    {
+                        tree.erase(empties[k]);
+                        STATS_ADD(counting_combine_tree, rewrites, 1);
+                    }
+                    empties.clear();
+                    empties_gone = g;
                 }
             }
+            group.swap(kept); // one alternative for each range now
+
+            if(changed)
+            {
+                did_changes = true;
+                if(!Step()) return true;
+                if(empties_gone <= g && empties_gone > 0) again = true;
+            }
         }
-        if(changed)
+    }
+
+    return did_changes;
+}
+
+/* Factors out the last (at_end) or the first item shared by
+ * several alternatives: (abc|dbc|koo) -> ((a|d)bc|koo).
+ *
+ * The alternatives are bucketed by the hash of that item, so all
+ * groups are found in one pass. Merging used to stop after the first
+ * group, because the new alternative could join a group in the next
+ * round. Now the merging goes on for as long as the new alternatives
+ * are certain not to interact with the rest: their edge items must
+ * not collide with those of any other alternative, and they must not
+ * be lone items that FlattenTree or CharsetCombineTree would touch.
+ * The result is thus the same as when merging one group per round.
+ */
+static bool CombineGroups(choices& tree, bool at_end, SubsumeChecked checked)
+{
+    struct Member
+    {
+        choices::iterator i;
+        std::size_t first, last; // hashes of the edge items
+    };
+    typedef std::unordered_map<std::size_t, unsigned> HashCount;
+
+    std::vector<std::vector<Member> > groups;
+    std::unordered_multimap<std::size_t, unsigned> buckets;
+    HashCount firsts, lasts;
+
+    for(choices::iterator i=tree.begin(); i!=tree.end(); ++i)
+    {
+        if(i->empty()) continue;
+
+        Member m;
+        m.i     = i;
+        m.last  = i->back().hash();
+        m.first = at_end ? 0 : i->front().hash();
+        ++lasts[m.last];
+        if(!at_end) ++firsts[m.first];
+
+        std::size_t key = at_end ? m.last : m.first;
+        std::pair<std::unordered_multimap<std::size_t, unsigned>::iterator,
+                  std::unordered_multimap<std::size_t, unsigned>::iterator>
+            range = buckets.equal_range(key);
+        unsigned g = groups.size();
+        for(; range.first != range.second; ++range.first)
+        {
+            const sequence& head = *groups[range.first->second][0].i;
+            if(at_end ? IsEqualSequenceAtEnd(head, *i, 1)
+                      : IsEqualSequenceAtBegin(head, *i, 1))
+                { g = range.first->second; break; }
+        }
+        if(g == groups.size())
         {
-            did_changes = true;
-            goto redo_combine;
+            groups.push_back(std::vector<Member>());
+            buckets.insert(std::make_pair(key, g));
         }
+        groups[g].push_back(m);
     }
 
-    return did_changes;
+    bool changed = false;
+    for(unsigned g=0; g<groups.size() && !Current->exhausted; ++g)
+    {
+        const std::vector<Member>& com = groups[g];
+        if(com.size() < 2) continue;
+
+        Estimate before = NoAlternatives();
+        if(Current->options->cost_model)
+            for(unsigned k=0; k<com.size(); ++k)
+                AddAlternative(before, EstimateSequence(com[k].i->begin(), com[k].i->end()));
+
+        sequence rep = at_end ? CopySequenceFromEnd(*com[0].i, 1)   // Copy the common part
+                              : CopySequenceFromBegin(*com[0].i, 1);
+        choices subchoice;
+
+        bool has_empty = false;
+        for(unsigned k=0; k<com.size(); ++k)
+        {
+            const sequence& kik = *com[k].i;
+            if(kik.size() == 1)
+                has_empty = true;
+            else if(at_end) // Leave out the common part
+                subchoice.push_back(sequence(kik.begin(), kik.end()-1));
+            else
+                subchoice.push_back(sequence(kik.begin()+1, kik.end()));
+        }
+        if(!subchoice.empty())
+        {
+            item it;
+            it.tree = NewChoices(subchoice);
+            if(has_empty) { it.min=0; } // make it optional
+            /* If no alternative of the tree contains another, neither
+             * does one of what is left of them, so SubsumeTree need
+             * not compare these again. */
+            Current->combined_checked = checked;
+            it.Optimize();
+            Current->combined_checked = checked_none;
+            // Insert the new tree next to the common part
+            if(at_end)
+                rep.insert(rep.begin(), it);
+            else
+                rep.insert(rep.end(), it);
+        }
+
+        /* The next round of OptimizeTree would do this anyway.
+         * Do it now to see how the new alternative turns out. */
+        OptimizeSequence(rep);
+
+        if(Current->options->cost_model)
+        {
+            Estimate after = NoAlternatives();
+            AddAlternative(after, EstimateSequence(rep.begin(), rep.end()));
+            if(!Affordable(before, after)) continue;
+        }
+        for(unsigned k=0; k<com.size(); ++k)
+        {
+            --lasts[com[k].last];
+            if(!at_end) --firsts[com[k].first];
+            tree.erase(com[k].i);
+        }
+        changed = true;
+        STATS_ADD(combine_tree, rewrites, 1);
+        tree.push_back(rep);
+
+        if(rep.size() < 2) return true;
+        std::size_t last  = rep.back().hash();
+        std::size_t first = at_end ? 0 : rep.front().hash();
+        if(lasts[last] || (!at_end && firsts[first])) return true;
+        ++lasts[last];
+        if(!at_end) ++firsts[first];
+    }
+    return changed;
 }
 
-static bool CombineTree(choices& tree)
+/* "checked" tells of which alternatives of the tree SubsumeTree
+ * has found none to be contained in another. */
+static bool CombineTree(choices& tree, SubsumeChecked checked)
 {
     // (abc | dbc)   ->   ((a|d)bc)  -> [ad]bc
 
@@ -460,118 +1549,610 @@ static bool CombineTree(choices& tree)
     // (aab | ab) -> a(ab|b) -> a(a|)b
     // a{1,2}b
 
+    STATS_PASS(combine_tree);
+    STATS_ADD(combine_tree, nodes, tree.size());
+
     // Combine those that have common ending
-    for(choices::iterator i=tree.begin(); i!=tree.end(); ++i)
+    if(CombineGroups(tree, true, checked)) return true;
+
+    // Combine those that have common beginning
+    return CombineGroups(tree, false, checked);
+}
+
+/* Redundancy removal. */
+
+/* The automata that is_subset_of and SubsumeTree compare are kept
+ * this small; where they would grow larger, the answer is "no". */
+static const unsigned SubsetMaxStates    = 512;
+static const unsigned SubsetMaxNfaStates = 4096;
+/* SubsumeTree compares at most this many pairs of alternatives
+ * per call by their automata. */
+static const unsigned SubsumeMaxAutomata = 64;
+/* Literal alternatives longer than this are not spelled out,
+ * and other ones with more items than this are left alone. */
+static const std::size_t SubsumeMaxLiteral = 1024;
+static const std::size_t SubsumeMaxItems   = 64;
+
+static bool Nullable(const item& it);
+static charset FirstBytes(const sequence& seq, std::size_t from, bool& open);
+
+/* Whether a is a subset of b, where the items alone tell:
+ * 1 if it is, 0 if it is not, -1 if the automata must tell. */
+static int CheapSubset(const item& a, const item& b, const regexopt_arena& arena)
+{
+    if(a.possessive || b.possessive) return a == b;
+    if(a.max == 0) return Nullable(b); // only the empty string
+
+    if(!a.tree && !b.tree)
+    {
+        const charset& set = arena.charset(a.ch);
+        if(set.none()) return a.min ? 1 : Nullable(b);
+
+        /* Every count of a must be one of b. Zero repeats
+         * of any charset match the same empty string. */
+        if(a.min == 0 && b.min != 0) return 0;
+        unsigned a_min = a.min ? a.min : 1;
+        return set.is_subset_of(arena.charset(b.ch)) && a_min >= b.min && a.max <= b.max;
+    }
+    if(a.is_equal(b) && a.min >= b.min && a.max <= b.max) return 1;
+    return -1;
+}
+
+static regexopt_dfa_options SubsetDfaOptions()
+{
+    regexopt_dfa_options options;
+    options.anchored       = true;
+    options.max_states     = SubsetMaxStates;
+    options.max_nfa_states = SubsetMaxNfaStates;
+    return options;
+}
+
+bool regexopt_item::is_subset_of(const regexopt_item& b, const regexopt_arena& arena) const
+{
+    int cheap = CheapSubset(*this, b, arena);
+    if(cheap >= 0) return cheap;
+
+    choices ta, tb;
+    ta.push_back(sequence(1, *this));
+    tb.push_back(sequence(1, b));
+    try
+    {
+        return RegexOptIncluded(regexopt_dfa(ta, arena, SubsetDfaOptions()),
+                                regexopt_dfa(tb, arena, SubsetDfaOptions()));
+    }
+    catch(const std::string&) { return false; }
+}
+
+/* Lengths of matches, with ~0 for no limit. */
+static const unsigned long long Unbounded = ~0ULL;
+
+static unsigned long long AddLength(unsigned long long a, unsigned long long b)
+{
+    return a > Unbounded - b ? Unbounded : a + b;
+}
+static unsigned long long MulLength(unsigned long long len, unsigned count)
+{
+    if(!len || !count) return 0;
+    if(count == uinf || len > Unbounded / count) return Unbounded;
+    return len * count;
+}
+
+static void MatchLengths(const choices& tree, unsigned long long& min, unsigned long long& max);
+static void MatchLengths(const sequence& seq, unsigned long long& min, unsigned long long& max)
+{
+    min = max = 0;
+    for(sequence::const_iterator i=seq.begin(); i!=seq.end(); ++i)
+    {
+        unsigned long long imin = 1, imax = 1;
+        if(i->tree) MatchLengths(*i->tree, imin, imax);
+        min = AddLength(min, MulLength(imin, i->min));
+        max = AddLength(max, MulLength(imax, i->max));
+    }
+}
+static void MatchLengths(const choices& tree, unsigned long long& min, unsigned long long& max)
+{
+    min = tree.empty() ? 0 : Unbounded; // (?:) matches ""
+    max = 0;
+    for(choices::const_iterator i=tree.begin(); i!=tree.end(); ++i)
+    {
+        unsigned long long smin, smax;
+        MatchLengths(*i, smin, smax);
+        min = std::min(min, smin);
+        max = std::max(max, smax);
+    }
+}
+
+/* The bytes that its matches may contain. */
+static charset UsedBytes(const choices& tree);
+static charset UsedBytes(const sequence& seq)
+{
+    charset result;
+    for(sequence::const_iterator i=seq.begin(); i!=seq.end(); ++i)
+        if(i->max != 0)
+            result |= i->tree ? UsedBytes(*i->tree) : Current->arena->charset(i->ch);
+    return result;
+}
+static charset UsedBytes(const choices& tree)
+{
+    charset result;
+    for(choices::const_iterator i=tree.begin(); i!=tree.end(); ++i)
+        result |= UsedBytes(*i);
+    return result;
+}
+
+/* Whether the alternative matches one string only, and
+ * if so, spells it out (if "text" is given). */
+static bool LiteralText(const sequence& seq, std::string* text = 0)
+{
+    const regexopt_arena& arena = *Current->arena;
+    std::size_t length = 0;
+    for(sequence::const_iterator i=seq.begin(); i!=seq.end(); ++i)
+    {
+        if(i->tree || i->min != i->max) return false;
+        length += i->min;
+        if(!arena.single(i->ch) || length > SubsumeMaxLiteral) return false;
+    }
+    if(text)
+        for(sequence::const_iterator i=seq.begin(); i!=seq.end(); ++i)
+            text->append(i->min, (char)arena.charset(i->ch).first());
+    return true;
+}
+
+/* Whether the alternative has at most "left" items, counting
+ * the ones in subtrees. Stops as soon as it has not. */
+static bool FewItems(const choices& tree, std::size_t& left);
+static bool FewItems(const sequence& seq, std::size_t& left)
+{
+    for(sequence::const_iterator i=seq.begin(); i!=seq.end(); ++i)
     {
-        std::list<choices::iterator> com;
-        com.push_back(i);
-        for(choices::iterator j=i; ++j!=tree.end(); )
+        if(!left) return false;
+        --left;
+        if(i->tree && !FewItems(*i->tree, left)) return false;
+    }
+    return true;
+}
+static bool FewItems(const choices& tree, std::size_t& left)
+{
+    for(choices::const_iterator i=tree.begin(); i!=tree.end(); ++i)
+        if(!FewItems(*i, left)) return false;
+    return true;
+}
+
+static std::size_t SequenceHash(const sequence& seq)
+{
+    std::size_t h = seq.size();
+    for(sequence::const_iterator i=seq.begin(); i!=seq.end(); ++i)
+        HashCombine(h, i->hash());
+    return h;
+}
+
+/* Appends to text one match of the alternative: each count at its
+ * minimum, made of the first alternative of each subtree and the
+ * lowest byte of each charset, or the last and the highest ones.
+ * Fails if the match would be too long (or there is none). */
+static bool SampleText(const choices& tree, bool high, std::string& text);
+static bool SampleText(const sequence& seq, bool high, std::string& text)
+{
+    for(sequence::const_iterator i=seq.begin(); i!=seq.end(); ++i)
+        for(unsigned n=0; n<i->min; ++n)
         {
-            if(IsEqualSequenceAtEnd(*i, *j, 1)) com.push_back(j);
+            if(i->tree)
+            {
+                if(!SampleText(*i->tree, high, text)) return false;
+                continue;
+            }
+            const charset& set = Current->arena->charset(i->ch);
+            if(set.none() || text.size() >= SubsumeMaxLiteral) return false;
+            text += (char)(high ? set.last() : set.first());
         }
-        if(com.size() > 1)
-        {
-            sequence rep = CopySequenceFromEnd(*i, 1); // Copy the common part
-            choices subchoice;
+    return true;
+}
+static bool SampleText(const choices& tree, bool high, std::string& text)
+{
+    if(tree.empty()) return true;
+    choices::const_iterator i = tree.begin();
+    if(high)
+        for(choices::const_iterator j = i; j != tree.end(); ++j) i = j;
+    return SampleText(*i, high, text);
+}
 
-            bool has_empty = false;
-            for(std::list<choices::iterator>::iterator
-                k = com.begin(); k != com.end(); ++k)
-            {
-                choices::iterator& ki = *k;
-                sequence& kik = *ki;
+/* Replaces the positions of text in "at" with the positions where
+ * a match that begins at one of them can end. This tells whether
+ * a tree matches a short string without compiling an automaton. */
+static void MatchEnds(const choices& tree, const std::string& text, std::vector<bool>& at);
+static void MatchOnce(const item& it, const std::string& text, std::vector<bool>& at)
+{
+    if(it.tree) { MatchEnds(*it.tree, text, at); return; }
+    const charset& set = Current->arena->charset(it.ch);
+    for(std::size_t p = text.size(); p-- > 0; )
+        at[p+1] = at[p] && set[(unsigned char)text[p]];
+    at[0] = false;
+}
+static void MatchEnds(const item& it, const std::string& text, std::vector<bool>& at)
+{
+    std::vector<bool> before;
+    for(unsigned n=0; n<it.min; ++n)
+    {
+        if(n+1 < it.max) before = at;
+        MatchOnce(it, text, at);
+        if(n+1 < it.max && at == before) return; // so are the rest of the repeats
+    }
+    if(it.max == it.min) return;
 
-                RemoveSequenceFromEnd(kik, 1); // Remove the common part
-                if(kik.empty())
-                    has_empty = true;
-                else
-                    subchoice.push_back(kik);
-                tree.erase(ki);
-            }
-            if(!subchoice.empty())
+    /* The optional repeats: only the positions reached for
+     * the first time need to be tried again. */
+    std::vector<bool> reach = at, fresh = at;
+    for(unsigned n=it.min; n<it.max; ++n)
+    {
+        MatchOnce(it, text, fresh);
+        bool grew = false;
+        for(std::size_t p=0; p<fresh.size(); ++p)
+            if(fresh[p])
             {
-                item it;
-                it.tree = new choices(subchoice);
-                if(has_empty) { it.min=0; } // make it optional
-                it.Optimize();
-                rep.insert(rep.begin(), it);
-                // Insert the new tree into the beginning of the new choice
+                if(reach[p]) fresh[p] = false;
+                else reach[p] = grew = true;
             }
-            tree.push_back(rep);
-            return true;
+        if(!grew) break;
+    }
+    at.swap(reach);
+}
+static void MatchEnds(const sequence& seq, const std::string& text, std::vector<bool>& at)
+{
+    for(sequence::const_iterator i=seq.begin(); i!=seq.end(); ++i)
+    {
+        if(std::find(at.begin(), at.end(), true) == at.end()) return;
+        MatchEnds(*i, text, at);
+    }
+}
+static void MatchEnds(const choices& tree, const std::string& text, std::vector<bool>& at)
+{
+    if(tree.empty()) return; // printed as (?:), so it matches ""
+    std::vector<bool> result(at.size(), false), ends;
+    for(choices::const_iterator i=tree.begin(); i!=tree.end(); ++i)
+    {
+        ends = at;
+        MatchEnds(*i, text, ends);
+        for(std::size_t p=0; p<ends.size(); ++p)
+            if(ends[p]) result[p] = true;
+    }
+    at.swap(result);
+}
+
+/* Whether the alternative matches the whole text. */
+static bool MatchesText(const sequence& seq, const std::string& text)
+{
+    std::vector<bool> at(text.size() + 1, false);
+    at[0] = true;
+    MatchEnds(seq, text, at);
+    return at[text.size()];
+}
+
+/* What SubsumeTree knows of an alternative. */
+struct SubsumeInfo
+{
+    choices::iterator i;
+    bool dead;
+    bool literal;                     // if so, it only matches text
+    std::string text;
+    std::vector<std::string> samples; // otherwise, some of its matches
+    bool sampled;
+    charset first;                    // the bytes that its matches begin with
+    bool measured;                    // if so, also these:
+    unsigned long long min, max;      // lengths of its matches
+    charset used;                     // the bytes that they contain
+    std::unique_ptr<regexopt_dfa> dfa;
+    bool too_large;                   // for a dfa
+
+    SubsumeInfo(): i(), dead(false), literal(false), text(), samples(),
+                   sampled(false), first(), measured(false), min(0), max(0),
+                   used(), dfa(), too_large(false) { }
+};
+
+/* Fills in what takes a walk through the whole alternative. */
+static void Measure(SubsumeInfo& s)
+{
+    if(s.measured) return;
+    MatchLengths(*s.i, s.min, s.max);
+    s.used = UsedBytes(*s.i);
+    s.measured = true;
+}
+
+/* Compiles s.dfa if it is not there yet. Returns false
+ * if it would be too large. */
+static bool SubsumeAutomaton(SubsumeInfo& s)
+{
+    if(s.dfa) return true;
+    if(s.too_large) return false;
+    try
+    {
+        choices tree;
+        tree.push_back(*s.i);
+        s.dfa.reset(new regexopt_dfa(tree, *Current->arena, SubsetDfaOptions()));
+        return true;
+    }
+    catch(const std::string&)
+    {
+        s.too_large = true;
+        return false;
+    }
+}
+
+/* Whether b matches the samples of a. */
+static bool MatchesSamples(const sequence& b, SubsumeInfo& a)
+{
+    if(!a.sampled)
+    {
+        a.sampled = true;
+        for(unsigned high=0; high<2; ++high)
+        {
+            std::string text;
+            if(SampleText(*a.i, high, text)) a.samples.push_back(text);
         }
     }
+    for(std::size_t k=0; k<a.samples.size(); ++k)
+        if(!MatchesText(b, a.samples[k])) return false;
+    return true;
+}
 
-    // Combine those that have common beginning
-    // This loop is equal to the previous, except
-    // that Begin/begin/back and End/end/front are swapped.
-    for(choices::iterator i=tree.begin(); i!=tree.end(); ++i)
+/* Whether b matches every string that a matches. */
+static bool Subsumes(SubsumeInfo& b, SubsumeInfo& a, unsigned& budget)
+{
+    const sequence& sa = *a.i;
+    const sequence& sb = *b.i;
+
+    /* Item by item, where the shapes agree. */
+    if(sa.size() == sb.size())
     {
-        std::list<choices::iterator> com;
-        com.push_back(i);
-        for(choices::iterator j=i; ++j!=tree.end(); )
+        if(sa.size() == 1)
         {
-            if(IsEqualSequenceAtBegin(*i, *j, 1)) com.push_back(j);
+            int cheap = CheapSubset(sa[0], sb[0], *Current->arena);
+            if(cheap >= 0) return cheap;
         }
-        if(com.size() > 1)
+        std::size_t k = 0;
+        while(k < sa.size() && CheapSubset(sa[k], sb[k], *Current->arena) == 1) ++k;
+        if(k == sa.size()) return true;
+    }
+
+    if(a.literal) return MatchesText(sb, a.text);
+    if(!MatchesSamples(sb, a)) return false;
+
+    /* The automata decide the rest, unless this pair has been
+     * ruled out before. The budget is spent either way, so that
+     * the result does not depend on what came before. */
+    if(!budget) return false;
+    --budget;
+    std::size_t key = SequenceHash(sb);
+    HashCombine(key, SequenceHash(sa));
+    if(Current->unsubsumed.count(key)) return false;
+
+    bool result = SubsumeAutomaton(a) && SubsumeAutomaton(b)
+               && RegexOptIncluded(*a.dfa, *b.dfa);
+    if(!result) Current->unsubsumed.insert(key);
+    return result;
+}
+
+/* Drops the alternatives that match nothing that another one
+ * does not: xfooy|x[a-q]+y -> x[a-q]+y.
+ *
+ * An alternative can only contain another one that begins with
+ * the same bytes, so first the ones whose first bytes no other
+ * alternative shares are set aside; mostly the first item tells.
+ * A literal alternative can only contain itself, so only the
+ * others are compared against the rest, and only the literals
+ * that begin like one of them. The lengths of the matches and
+ * the bytes in them rule out most pairs. Of the rest, the
+ * literals are matched against the wider alternative directly,
+ * and so are two sample matches of the others, which are then
+ * compared as automata if the samples match. Of two alternatives
+ * that match the same strings, the first one stays.
+ *
+ * A literal matches one string, so once it has been compared, it
+ * can only be contained in what the other alternatives are merged
+ * into if it was in one of them already. "checked" tells whether
+ * the literals are to be compared again, and is set to checked_all
+ * if every pair was decided, rather than left alone for its size
+ * or for the budget.
+ */
+static bool SubsumeTree(choices& tree, SubsumeChecked& checked)
+{
+    STATS_PASS(subsume_tree);
+    if(tree.size() < 2) { checked = checked_all; return false; }
+    bool literals = checked == checked_none, complete = true;
+
+    /* Only the small alternatives that are not literal can contain
+     * others, and a literal can only be contained in one of them
+     * if its first bytes are among theirs. Neither can one whose
+     * first bytes no other alternative begins with, unless one
+     * matches the empty string only, which any nullable one does.
+     * Mostly the first item tells the first bytes, so the other
+     * alternatives are only counted when that leaves them in.
+     * The scratch space is kept for the next call. */
+    struct Candidate
+    {
+        choices::iterator i;
+        charset first;
+        enum { literal, other, wide } kind;
+    };
+    static thread_local std::vector<Candidate> candidates;
+    candidates.clear();
+    charset once, twice;
+    bool any_empty = false;
+    for(choices::iterator i = tree.begin(); i != tree.end(); ++i)
+    {
+        const sequence& seq = *i;
+        Candidate c = { i, charset(), Candidate::other };
+        if(LiteralText(seq))
         {
-            sequence rep = CopySequenceFromBegin(*i, 1);
-            choices subchoice;
-            bool has_empty = false;
-            for(std::list<choices::iterator>::iterator
-                k = com.begin(); k != com.end(); ++k)
-            {
-                choices::iterator& ki = *k;
-                sequence& kik = *ki;
+            if(!literals) continue;
+            c.kind = Candidate::literal;
+        }
 
-                RemoveSequenceFromBegin(kik, 1);
-                if(kik.empty())
-                    has_empty = true;
-                else
-                    subchoice.push_back(kik);
-                tree.erase(ki);
-            }
-            if(!subchoice.empty())
+        if(!seq.empty() && !seq[0].tree && seq[0].min)
+            c.first = Current->arena->charset(seq[0].ch);
+        else
+        {
+            std::size_t left = SubsumeMaxItems;
+            if(c.kind == Candidate::other)
             {
-                item it;
-                it.tree = new choices(subchoice);
-                if(has_empty) { it.min=0; } // make it optional
-                it.Optimize();
-                rep.insert(rep.end(), it);
-                // Insert the new tree into the end of the new choice
+                if(!FewItems(seq, left)) { complete = false; continue; }
+                c.kind = Candidate::wide;
             }
-            tree.push_back(rep);
-            return true;
+            bool open;
+            c.first = FirstBytes(seq, 0, open);
+            if(c.first.none()) any_empty = true;
         }
+        twice |= once & c.first;
+        once  |= c.first;
+        candidates.push_back(c);
     }
-    return false;
+
+    charset wide_first;
+    bool any_wide = false;
+    for(std::size_t a=0; a<candidates.size(); ++a)
+    {
+        Candidate& c = candidates[a];
+        if(c.kind == Candidate::literal) continue;
+        if(!any_empty && !c.first.intersects(twice)) continue;
+        std::size_t left = SubsumeMaxItems;
+        if(c.kind == Candidate::other && !FewItems(*c.i, left)) { complete = false; continue; }
+        c.kind = Candidate::wide;
+        wide_first |= c.first;
+        any_wide = true;
+    }
+    if(!any_wide)
+    {
+        if(complete) checked = checked_all;
+        return false;
+    }
+
+    std::vector<SubsumeInfo> alts;
+    for(std::size_t a=0; a<candidates.size(); ++a)
+    {
+        const Candidate& c = candidates[a];
+        if(c.kind == Candidate::other) continue;
+        if(!any_empty && !c.first.intersects(twice)) continue;
+        bool literal = c.kind == Candidate::literal;
+        if(literal && !c.first.is_subset_of(wide_first)) continue;
+
+        alts.emplace_back();
+        SubsumeInfo& s = alts.back();
+        s.i = c.i;
+        s.literal = literal;
+        if(s.literal) LiteralText(*c.i, &s.text);
+        s.first = c.first;
+    }
+    std::size_t n = alts.size();
+    STATS_ADD(subsume_tree, nodes, n);
+
+    bool changed = false;
+    unsigned budget = SubsumeMaxAutomata;
+    for(std::size_t b=0; b<n; ++b)
+    {
+        SubsumeInfo& wider = alts[b];
+        if(wider.literal || wider.dead) continue;
+        for(std::size_t a=0; a<n; ++a)
+        {
+            SubsumeInfo& narrower = alts[a];
+            if(a == b || narrower.dead) continue;
+            if(!narrower.first.is_subset_of(wider.first)) continue;
+            Measure(narrower);
+            Measure(wider);
+            if(narrower.min < wider.min || narrower.max > wider.max
+            || !narrower.used.is_subset_of(wider.used)) continue;
+            if(!Subsumes(wider, narrower, budget)) continue;
+
+            tree.erase(narrower.i);
+            narrower.dead = true;
+            changed = true;
+            STATS_ADD(subsume_tree, rewrites, 1);
+        }
+    }
+    if(!budget) complete = false;
+    for(std::size_t a=0; a<n; ++a)
+        if(alts[a].too_large) complete = false;
+    if(complete) checked = checked_all;
+    return changed;
 }
 
 static void OptimizeTree(choices& tree)
 {
+    STATS_PASS(optimize_tree);
+    tree.Changed();
+    /* How much of the alternatives SubsumeTree has compared: all of
+     * them if they are what is left of alternatives that it has
+     * compared in the tree that they were taken from. Merging
+     * alternatives leaves the literals compared, but flattening a
+     * group does not. "stale" tells whether they have changed since
+     * SubsumeTree last ran; if not, it would only do the same again. */
+    SubsumeChecked checked = Current->combined_checked;
+    Current->combined_checked = checked_none;
+    bool stale = checked != checked_all;
+    bool finished = false, subsumed = false;
     for(;;)
     {
+        if(!Step()) break; // out of budget: the tree is valid as it is
+        tree.Compact();
+        STATS_ADD(optimize_tree, iterations, 1);
+        STATS_ADD(optimize_tree, nodes, tree.size());
+        /* Only an alternative that is not literal can contain another,
+         * so where there is none, SubsumeTree has nothing to compare.
+         * Looking for one here finds the items still in the cache.
+         * (Where the literals have been compared, SubsumeTree passes
+         * over them anyway.) */
+        bool wide = false;
         for(choices::iterator i=tree.begin(); i!=tree.end(); ++i)
+        {
             OptimizeSequence(*i);
+            if(checked == checked_none && !subsumed && !wide && !LiteralText(*i))
+                wide = true;
+        }
 
-        FlattenTree(tree);
-        CharsetCombineTree(tree);
-
-        bool changed = CombineTree(tree) || CountingCombineTree(tree);
-        if(!changed) break;
+        if(FlattenTree(tree)) { checked = checked_none; stale = wide = true; }
+        /* Once before the alternatives are combined, and again
+         * when nothing else is left to do. */
+        if(!subsumed)
+        {
+            if(stale)
+            {
+                if(checked == checked_none && !wide) checked = checked_all;
+                else SubsumeTree(tree, checked);
+            }
+            stale = false;
+            subsumed = true;
+        }
+        if(CharsetCombineTree(tree))
+        {
+            if(checked == checked_all) checked = checked_literals;
+            stale = true;
+        }
+        bool changed = CombineTree(tree, checked) || CountingCombineTree(tree);
+        if(changed)
+        {
+            if(checked == checked_all) checked = checked_literals;
+            stale = true;
+        }
+        else if(stale)
+        {
+            changed = SubsumeTree(tree, checked);
+            stale = false;
+        }
+        if(!changed) { finished = true; break; }
 
-        FlattenTree(tree);
+        if(FlattenTree(tree)) { checked = checked_none; stale = true; }
     }
 
+    tree.Compact();
     for(choices::iterator i=tree.begin(); i!=tree.end(); ++i)
         HeavyCompressSequence(*i);
+    tree.Changed();
+    if(finished) tree.MarkOptimized();
 }
 
 void item::Optimize()
 {
     if(tree)
     {
-        OptimizeTree(*tree);
+        if(!tree->frozen() && !tree->optimized()) OptimizeTree(*tree);
 
         // Convert (x) to x
         // Convert (x{5,7}) to x{5,7}
@@ -587,30 +2168,28 @@ void item::Optimize()
             {
                 const item& it = seq[0];
 
+                /* The abandoned node is left for the arena to free. */
                 if(min==1 && max==1)
                 {
-                    choices* tmp = tree;
                     *this = it;
-                    delete tmp;
                 }
                 else if(it.min==1 && it.max==1)
                 {
-                    choices* tmp = tree;
                     tree = it.tree;
                     ch   = it.ch;
-                    delete tmp;
                 }
-                else if(it.min==0 && min==max)
+                else if(it.min==0 && min==max
+                     && (it.max == uinf || (unsigned long long)max * it.max < uinf))
                 {
-                    choices* tmp = tree;
                     min = 0;
-                    max *= it.max;
+                    max = it.max == uinf ? uinf : max * it.max;
                     tree = it.tree;
                     ch   = it.ch;
-                    delete tmp;
                 }
             }
         }
+        if(tree && Current->options->intern_subtrees)
+            tree = InternTree(tree);
     }
 }
 
@@ -731,39 +2310,301 @@ static const charset& GetCntrlMask()
     return data.result;
 }
 
-static const charset ParseEscape(const std::string& s, unsigned& pos)
+/* A pool of threads for optimizing subtrees in parallel.
+ *
+ * Each thread has a deque of tasks. It pushes the tasks that
+ * it spawns to the back of its own deque and takes work from
+ * there too, newest first; a thread that runs out steals from
+ * the front of the others, oldest (and usually largest) first.
+ * A thread waiting for a task runs other tasks meanwhile, so
+ * that nested waits cannot deadlock. The thread that made the
+ * pool is worker 0.
+ */
+class TaskPool
 {
-    unsigned b=s.size();
-    if(pos+1 < b) ++pos;
-    char c = s[pos];
-    switch(c)
+public:
+    typedef void (*Function)(void* data);
+
+    explicit TaskPool(unsigned num_threads);
+    ~TaskPool();
+
+    /* Queues run(data). pending is incremented now,
+     * and decremented when the task has run. */
+    void Spawn(Function run, void* data, std::atomic<unsigned>& pending);
+    /* Runs tasks until pending is 0. */
+    void Wait(const std::atomic<unsigned>& pending);
+
+private:
+    struct Task
     {
-        case 't': { charset result; result.set('\t'); return result; }
-        case 'n': { charset result; result.set('\n'); return result; }
-        case 'r': { charset result; result.set('\r'); return result; }
-        case 'v': { charset result; result.set('\v'); return result; }
-        case 'f': { charset result; result.set('\f'); return result; }
-        case 'a': { charset result; result.set('\a'); return result; }
-        case 'e': { charset result; result.set(27); return result; }
-        case 'c': { charset result; result.set(toupper(s[++pos]) ^ 64); return result; }
-        case 'd': return GetDecMask();
-        case 'D': return ~GetDecMask();
-        case 's': return GetPSpaceMask();
-        case 'S': return ~GetPSpaceMask();
-        case 'w': return GetWordMask();
-        case 'W': return ~GetWordMask();
-        case 'x':
-        {
-            unsigned hex = 0, ndigits=0;
-            for(; ndigits < 2 && pos+1 < b && isxdigit(s[pos+1]); ++ndigits)
-            {
-                c = s[++pos];
-                hex = hex*16;
-                if(isdigit(c)) hex += (c-'0');
-                else if(islower(c)) hex += (c-'a'+10);
-                else if(isupper(c)) hex += (c-'A'+10);
-            }
-            { charset result; result.set(hex); return result; }
+        Function run;
+        void* data;
+        std::atomic<unsigned>* pending;
+    };
+    struct Queue
+    {
+        std::mutex lock;
+        std::deque<Task> tasks;
+    };
+
+    std::deque<Queue> queues; // one per worker
+    std::vector<std::thread> threads;
+    std::mutex sleep_lock;
+    std::condition_variable wake;
+    long queued; // tasks in the queues; guarded by sleep_lock
+    bool stop;
+
+    unsigned Self() const;
+    bool Take(unsigned self, Task& task);
+    void Finish(const Task& task);
+    void Work(unsigned self);
+
+    TaskPool(const TaskPool&);
+    void operator= (const TaskPool&);
+};
+
+/* The pool that the current thread works for, and its index there. */
+static thread_local const TaskPool* WorkerPool = 0;
+static thread_local unsigned WorkerIndex = 0;
+
+TaskPool::TaskPool(unsigned num_threads)
+    : queues(), threads(), sleep_lock(), wake(), queued(0), stop(false)
+{
+    for(unsigned a=0; a<num_threads; ++a) queues.emplace_back();
+    for(unsigned a=1; a<num_threads; ++a) threads.push_back(std::thread(&TaskPool::Work, this, a));
+}
+
+TaskPool::~TaskPool()
+{
+    {
+        std::lock_guard<std::mutex> l(sleep_lock);
+        stop = true;
+    }
+    wake.notify_all();
+    for(std::size_t a=0; a<threads.size(); ++a) threads[a].join();
+}
+
+unsigned TaskPool::Self() const
+{
+    return WorkerPool == this ? WorkerIndex : 0;
+}
+
+void TaskPool::Spawn(Function run, void* data, std::atomic<unsigned>& pending)
+{
+    Task task = { run, data, &pending };
+    ++pending;
+    Queue& q = queues[Self()];
+    {
+        std::lock_guard<std::mutex> l(q.lock);
+        q.tasks.push_back(task);
+    }
+    {
+        std::lock_guard<std::mutex> l(sleep_lock);
+        ++queued;
+    }
+    wake.notify_one();
+}
+
+bool TaskPool::Take(unsigned self, Task& task)
+{
+    for(std::size_t a=0; a<queues.size(); ++a)
+    {
+        Queue& q = queues[(self + a) % queues.size()];
+        std::lock_guard<std::mutex> l(q.lock);
+        if(q.tasks.empty()) continue;
+        if(a == 0) { task = q.tasks.back();  q.tasks.pop_back(); }
+        else       { task = q.tasks.front(); q.tasks.pop_front(); }
+
+        std::lock_guard<std::mutex> s(sleep_lock);
+        --queued;
+        return true;
+    }
+    return false;
+}
+
+/* Counts the task as done. The last one of a Wait() wakes the
+ * threads, so that the one waiting for it stops sleeping. */
+void TaskPool::Finish(const Task& task)
+{
+    if(--*task.pending) return;
+    {
+        std::lock_guard<std::mutex> l(sleep_lock);
+    }
+    wake.notify_all();
+}
+
+void TaskPool::Work(unsigned self)
+{
+    WorkerPool  = this;
+    WorkerIndex = self;
+    for(;;)
+    {
+        Task task;
+        if(Take(self, task))
+        {
+            task.run(task.data);
+            Finish(task);
+            continue;
+        }
+        std::unique_lock<std::mutex> l(sleep_lock);
+        if(stop) return;
+        if(queued <= 0) wake.wait(l);
+    }
+}
+
+void TaskPool::Wait(const std::atomic<unsigned>& pending)
+{
+    unsigned self = Self();
+    while(pending)
+    {
+        Task task;
+        if(Take(self, task))
+        {
+            task.run(task.data);
+            Finish(task);
+            continue;
+        }
+        /* The rest is running elsewhere: sleep until it is done,
+         * or until there is something to take. */
+        std::unique_lock<std::mutex> l(sleep_lock);
+        if(pending && queued <= 0) wake.wait(l);
+    }
+}
+
+/* Groups with fewer items than this are not worth a thread. */
+static const std::size_t MinParallelItems = 256;
+
+/* The number of threads to optimize with, 1 if not in parallel. */
+static unsigned ParallelThreads()
+{
+    const regexopt_options& o = *Current->options;
+    if(o.threads == 1 || o.intern_subtrees || o.step_limit || o.time_limit > 0)
+        return 1;
+    if(o.threads) return o.threads;
+    unsigned n = std::thread::hardware_concurrency();
+    return n ? n : 1;
+}
+
+/* A group being optimized by the pool, in place, with an arena of
+ * its own that starts with the charsets of the parser's arena. The
+ * nodes of the group were made before it was handed out, and the
+ * parser leaves them alone until it collects the result. */
+struct SubtreeTask
+{
+    choices* tree;
+    regexopt_arena arena;
+    regexopt_options options;
+    regexopt_stats stats;
+    std::exception_ptr error;
+    std::atomic<unsigned> pending;
+
+    SubtreeTask();
+    ~SubtreeTask();
+
+    static void Run(void* data);
+
+private:
+    SubtreeTask(const SubtreeTask&);
+    void operator= (const SubtreeTask&);
+};
+
+SubtreeTask::SubtreeTask()
+    : tree(0), arena(), options(), stats(), error(), pending(0)
+{
+}
+
+SubtreeTask::~SubtreeTask()
+{
+}
+
+void SubtreeTask::Run(void* data)
+{
+    SubtreeTask& t = *static_cast<SubtreeTask*>(data);
+    try
+    {
+        ContextScope scope(t.arena, t.options);
+        OptimizeTree(*t.tree);
+    }
+    catch(...)
+    {
+        t.error = std::current_exception();
+    }
+}
+
+/* Hands the group to the pool. */
+static void SpawnOptimizeTree(TaskPool& pool, std::deque<SubtreeTask>& tasks, choices* tree)
+{
+    tasks.emplace_back();
+    SubtreeTask& t = tasks.back();
+    t.tree    = tree;
+    t.options = *Current->options;
+    t.options.partial = 0;
+    t.options.stats   = Current->options->stats ? &t.stats : 0;
+    Current->arena->Fork(t.arena);
+    pool.Spawn(SubtreeTask::Run, &t, t.pending);
+}
+
+/* Waits for the group to be optimized, and moves its
+ * nodes and charsets into the parser's arena. */
+static void CollectOptimizeTree(TaskPool& pool, SubtreeTask& t)
+{
+    pool.Wait(t.pending);
+    if(t.error) std::rethrow_exception(t.error);
+
+    std::vector<unsigned> ids;
+    Current->arena->Adopt(t.arena, ids);
+    for(std::size_t a=0; a<ids.size(); ++a)
+        if(ids[a] != a) { t.tree->RemapCharsets(ids); break; }
+    if(regexopt_stats* stats = Current->options->stats) *stats += t.stats;
+    t.arena.Clear();
+}
+
+/* Throws the message of a syntax error, with the byte offset
+ * in the regexp where it was found. */
+[[noreturn]] static void SyntaxError(const std::string& what, unsigned pos)
+{
+    throw what + " at byte " + std::to_string(pos);
+}
+
+/* The regexp being parsed is s[0..b), which need not be
+ * NUL-terminated: it may be a record inside a larger buffer. */
+
+static const charset ParseEscape(const char* s, unsigned b, unsigned& pos)
+{
+    if(pos+1 < b) ++pos;
+    char c = s[pos];
+    switch(c)
+    {
+        case 't': { charset result; result.set('\t'); return result; }
+        case 'n': { charset result; result.set('\n'); return result; }
+        case 'r': { charset result; result.set('\r'); return result; }
+        case 'v': { charset result; result.set('\v'); return result; }
+        case 'f': { charset result; result.set('\f'); return result; }
+        case 'a': { charset result; result.set('\a'); return result; }
+        case 'e': { charset result; result.set(27); return result; }
+        case 'c':
+        {
+            c = ++pos < b ? s[pos] : '\0';
+            charset result; result.set(toupper((unsigned char)c) ^ 64); return result;
+        }
+        case 'd': return GetDecMask();
+        case 'D': return ~GetDecMask();
+        case 's': return GetPSpaceMask();
+        case 'S': return ~GetPSpaceMask();
+        case 'w': return GetWordMask();
+        case 'W': return ~GetWordMask();
+        case 'x':
+        {
+            unsigned hex = 0, ndigits=0;
+            for(; ndigits < 2 && pos+1 < b && isxdigit(s[pos+1]); ++ndigits)
+            {
+                c = s[++pos];
+                hex = hex*16;
+                if(isdigit(c)) hex += (c-'0');
+                else if(islower(c)) hex += (c-'a'+10);
+                else if(isupper(c)) hex += (c-'A'+10);
+            }
+            { charset result; result.set(hex); return result; }
         }
         case '0': case '1': case '2': case '3':
         case '4': case '5': case '6': case '7':
@@ -776,15 +2617,52 @@ static const charset ParseEscape(const std::string& s, unsigned& pos)
                 c = s[++pos];
                 octal = octal*8 + (c-'0');
             }
+            if(octal > 0xFF) SyntaxError("Octal escape above \\377", pos);
             { charset result; result.set(octal); return result; }
         }
         default: { charset result; result.set((unsigned char)c); return result; }
     }
 }
 
-static const charset ParseCharSet(const std::string& s, unsigned& pos)
+/* The classes that may appear within brackets, as in [[:alpha:]_]. */
+static const struct BracketClass
+{
+    const char* name; // between "[:" and ":]"
+    unsigned length;
+    const charset& (*mask)();
+} BracketClasses[] =
+{
+    { "print", 5, GetPrintMask }, { "graph", 5, GetGraphMask },
+    { "ascii", 5, GetAsciiMask }, { "cntrl", 5, GetCntrlMask },
+    { "alpha", 5, GetAlphaMask }, { "alnum", 5, GetAlnumMask },
+    { "lower", 5, GetLowerMask }, { "upper", 5, GetUpperMask },
+    { "punct", 5, GetPunctMask }, { "space", 5, GetSpaceMask },
+    { "digit", 5, GetDecMask },   { "word",  4, GetWordMask },
+    { "xdigit",6, GetXdigitMask },
+    { 0, 0, 0 }
+};
+
+/* If s[pos..] begins with "[:name:]", moves pos to its
+ * last character and returns the class. Otherwise returns 0. */
+static const charset* ParseBracketClass(const char* s, unsigned b, unsigned& pos)
+{
+    if(pos+1 >= b || s[pos+1] != ':') return 0;
+    const char* name = s + pos + 2;
+    unsigned left = b - (pos+2);
+    for(const BracketClass* k = BracketClasses; k->name; ++k)
+        if(left >= k->length + 2
+        && !std::memcmp(name, k->name, k->length)
+        && name[k->length] == ':' && name[k->length+1] == ']')
+        {
+            pos += k->length + 3;
+            return &k->mask();
+        }
+    return 0;
+}
+
+static const charset ParseCharSet(const char* s, unsigned b, unsigned& pos)
 {
-    unsigned b=s.size();
+    unsigned open = pos;
     charset result;
     bool negative=false, begin=true, range_ok=false;
     bool was_range = false;
@@ -816,25 +2694,15 @@ static const charset ParseCharSet(const std::string& s, unsigned& pos)
             }
             case '\\':
             {
-                key = ParseEscape(s, pos);
+                key = ParseEscape(s, b, pos);
                 goto operand;
             }
             case '[':
             {
-                if(s.substr(pos, 9) == "[:print:]") { pos+=9-1; key = GetPrintMask(); goto operand; }
-                if(s.substr(pos, 9) == "[:graph:]") { pos+=9-1; key = GetGraphMask(); goto operand; }
-                if(s.substr(pos, 9) == "[:ascii:]") { pos+=9-1; key = GetAsciiMask(); goto operand; }
-                if(s.substr(pos, 9) == "[:cntrl:]") { pos+=9-1; key = GetCntrlMask(); goto operand; }
-                if(s.substr(pos, 9) == "[:alpha:]") { pos+=9-1; key = GetAlphaMask(); goto operand; }
-                if(s.substr(pos, 9) == "[:alnum:]") { pos+=9-1; key = GetAlnumMask(); goto operand; }
-                if(s.substr(pos, 9) == "[:lower:]") { pos+=9-1; key = GetLowerMask(); goto operand; }
-                if(s.substr(pos, 9) == "[:upper:]") { pos+=9-1; key = GetUpperMask(); goto operand; }
-                if(s.substr(pos, 9) == "[:punct:]") { pos+=9-1; key = GetPunctMask(); goto operand; }
-                if(s.substr(pos, 9) == "[:space:]") { pos+=9-1; key = GetSpaceMask(); goto operand; }
-                if(s.substr(pos, 9) == "[:digit:]") { pos+=9-1; key = GetDecMask(); goto operand; }
-                if(s.substr(pos, 8) == "[:word:]")  { pos+=8-1; key = GetWordMask(); goto operand; }
-                if(s.substr(pos, 10)== "[:xdigit:]"){ pos+=10-1;key = GetXdigitMask(); goto operand; }
-                goto literal;
+                const charset* named = ParseBracketClass(s, b, pos);
+                if(!named) goto literal;
+                key = *named;
+                goto operand;
             }
             default:
             {
@@ -850,8 +2718,8 @@ static const charset ParseCharSet(const std::string& s, unsigned& pos)
                 }
                 if(was_range)
                 {
-                    unsigned c1 = FindFirst(prev);
-                    unsigned c2 = FindFirst(key);
+                    unsigned c1 = prev.first();
+                    unsigned c2 = key.first();
                     if(c1 > c2) std::swap(c1, c2);
                     for(unsigned c=c1; c<=c2; ++c) key.set(c);
                     range_ok=false;
@@ -868,14 +2736,12 @@ static const charset ParseCharSet(const std::string& s, unsigned& pos)
         }
         begin=false;
     }
-    throw "Unmatched '[' - needs ']'"; // error
-    return result;
+    SyntaxError("Unmatched '[' - needs ']'", open);
 }
 
-static void ParseCount(const std::string& s, unsigned& pos, unsigned& min, unsigned& max)
+static void ParseCount(const char* s, unsigned b, unsigned& pos, unsigned& min, unsigned& max)
 {
-    unsigned b=s.size();
-
+    unsigned open = pos;
     unsigned value=0;
     unsigned index=0;
     bool has_value=false;
@@ -899,72 +2765,146 @@ static void ParseCount(const std::string& s, unsigned& pos, unsigned& min, unsig
             has_value=true;
         }
         else
-        {
-            std::cerr << "Invalid character: '" << (char)c << "'\n";
-            throw "Invalid character in '{}'"; // error
-        }
+            SyntaxError(std::string("Invalid character '") + c + "' in '{}'", pos);
     }
-    throw "Unmatched '{' - needs '}'"; // error
+    SyntaxError("Unmatched '{' - needs '}'", open);
 }
 
-static const choices Parse(const std::string& s, unsigned& pos)
+/* A group being parsed: the alternatives finished so far,
+ * the one in progress, and where the group was opened. */
+struct OpenGroup
 {
-    unsigned b=s.size();
-
-    bool count_ok = false;
     choices result;
     sequence seq;
+    bool has_empty;
+    unsigned open;
+    std::size_t items;               // items within, nested ones too
+    std::vector<SubtreeTask*> tasks; // nested groups given to the pool
+
+    explicit OpenGroup(unsigned open);
+    OpenGroup(const OpenGroup& b);
+    ~OpenGroup();
+
+    /* Ends the alternative in progress. */
+    void Alternative();
+    /* Ends the group, and returns its tree, not yet optimized. */
+    choices& Close();
+
+private:
+    void operator= (const OpenGroup&);
+};
+
+OpenGroup::OpenGroup(unsigned o)
+    : result(), seq(), has_empty(false), open(o), items(0), tasks()
+{
+}
+
+OpenGroup::OpenGroup(const OpenGroup& b)
+    : result(b.result), seq(b.seq), has_empty(b.has_empty), open(b.open),
+      items(b.items), tasks(b.tasks)
+{
+}
+
+OpenGroup::~OpenGroup()
+{
+}
+
+void OpenGroup::Alternative()
+{
+    if(seq.empty()) has_empty = true; else result.push_back(std::move(seq));
+    seq.clear();
+}
+
+choices& OpenGroup::Close()
+{
+    Alternative();
+    if(has_empty && !result.empty()) result.push_back(sequence());
+    return result;
+}
+
+/* Parses from pos up to the end of the regexp, or up to a ')'
+ * that closes nothing, and leaves pos there. The groups are kept
+ * on an explicit stack, so the nesting depth is limited only by
+ * memory, and each byte is looked at a bounded number of times. */
+static const choices Parse(const char* s, unsigned b, unsigned& pos)
+{
+    /* A deque: the groups are not moved as it grows. */
+    std::deque<OpenGroup> groups;
+    groups.push_back(OpenGroup(pos));
+
+    /* Each group is optimized when it is closed. Large ones are
+     * given to the pool, and collected when their parent closes. */
+    std::deque<SubtreeTask> tasks;
+    std::unique_ptr<TaskPool> pool; // made when first needed
+    const unsigned threads = Current->optimize ? ParallelThreads() : 1;
 
-    bool has_empty = false;
+    bool count_ok = false;
 
     for(; pos < b; ++pos)
     {
+        sequence& seq = groups.back().seq;
         charset key;
         switch(s[pos])
         {
             case '(':
             {
-                if(s.substr(pos+1,2) == "?:")
+                if(pos+2 < b && s[pos+1] == '?' && s[pos+2] == ':')
                 {
                     // ignore
                     pos += 2;
                 }
-                if(s[pos+1]=='?')
-                {
-                    std::string escape = s.substr(pos,3);
-                    throw std::string("Unexpected '?' escape \"") + escape + "\"";
-                }
-                regexopt_item ch;
-                ++pos;
-                ch.tree = new choices(Parse(s, pos));
-                seq.push_back(ch);
-                count_ok = true;
-                if(s[pos] != ')')
+                if(pos+1 < b && s[pos+1]=='?')
                 {
-                    throw "Unmatched '(' - needs ')'";
+                    std::string escape(s+pos, std::min(3u, b-pos));
+                    SyntaxError("Unexpected '?' escape \"" + escape + "\"", pos);
                 }
+                groups.push_back(OpenGroup(pos));
+                count_ok = false;
                 break;
             }
             case ')':
             {
-                goto fin;
+                if(groups.size() == 1) goto fin;
+                OpenGroup& group = groups.back();
+                for(std::size_t a=0; a<group.tasks.size(); ++a)
+                    CollectOptimizeTree(*pool, *group.tasks[a]);
+                regexopt_item ch;
+                ch.tree = NewChoices(group.Close());
+                std::size_t items = group.items;
+                groups.pop_back();
+
+                OpenGroup& parent = groups.back();
+                if(Current->optimize)
+                {
+                    if(threads > 1 && items >= MinParallelItems)
+                    {
+                        if(!pool) pool.reset(new TaskPool(threads));
+                        SpawnOptimizeTree(*pool, tasks, ch.tree);
+                        parent.tasks.push_back(&tasks.back());
+                    }
+                    else
+                        OptimizeTree(*ch.tree);
+                }
+                parent.seq.push_back(ch);
+                parent.items += items + 1;
+                count_ok = true;
+                break;
             }
             case '|':
             {
-                if(seq.empty()) has_empty = true; else result.push_back(seq);
-                seq.clear();
+                groups.back().Alternative();
                 count_ok = false;
                 break;
             }
             case '[': // character set
             {
-                key = ParseCharSet(s, pos);
+                key = ParseCharSet(s, b, pos);
                 goto gotchar;
             }
             //case ']': throw "Unexpected right bracket"; // not really error - handle as raw.
             case '\\':
             {
-                key = ParseEscape(s, pos);
+                key = ParseEscape(s, b, pos);
                 goto gotchar;
             }
             case '.': // any char but "\n"
@@ -982,8 +2922,7 @@ static const choices Parse(const std::string& s, unsigned& pos)
                     count_ok = false;
                     goto count_end;
                 }
-                throw "Unexpected '*'";
-                break;
+                SyntaxError("Unexpected '*'", pos);
             }
             case '+': // count: 1-inf
             {
@@ -995,8 +2934,7 @@ static const choices Parse(const std::string& s, unsigned& pos)
                     count_ok = false;
                     goto count_end;
                 }
-                throw "Unexpected '+'";
-                break;
+                SyntaxError("Unexpected '+'", pos);
             }
             case '?': // count: 0-1
             {
@@ -1008,8 +2946,7 @@ static const choices Parse(const std::string& s, unsigned& pos)
                     count_ok = false;
                     goto count_end;
                 }
-                throw "Unexpected '?'";
-                break;
+                SyntaxError("Unexpected '?'", pos);
             count_end:
                 if(pos+1<b && s[pos+1]=='?')
                 {
@@ -1021,10 +2958,11 @@ static const choices Parse(const std::string& s, unsigned& pos)
             }
             case '{': // count: "n,m" or "n," or "n" or ",m"
             {
+                unsigned open = pos;
                 unsigned n=0;
                 unsigned m=uinf;
 
-                ParseCount(s, pos, n,m);
+                ParseCount(s, b, pos, n,m);
 
                 if(count_ok)
                 {
@@ -1034,19 +2972,16 @@ static const choices Parse(const std::string& s, unsigned& pos)
                     count_ok = false;
                     goto count_end;
                 }
-                throw "Unexpected left bracet";
-                break;
+                SyntaxError("Unexpected left bracet", open);
             }
             //case '}': throw "Unexpected right bracet"; // not really error - handle as raw.
             case '^': // only string begin
             {
-                throw "string-begin '^' not handled, sorry";
-                break;
+                SyntaxError("string-begin '^' not handled, sorry", pos);
             }
             case '$': // only string end
             {
-                throw "string-end '$' not handled, sorry";
-                break;
+                SyntaxError("string-end '$' not handled, sorry", pos);
             }
             default:
             {
@@ -1054,59 +2989,197 @@ static const choices Parse(const std::string& s, unsigned& pos)
                 goto gotchar;
             gotchar:
                 regexopt_item ch;
-                ch.ch  = key;
+                ch.ch  = InternCharset(key);
                 seq.push_back(ch);
+                ++groups.back().items;
                 count_ok = true;
                 break;
             }
         }
     }
+    if(groups.size() > 1)
+        SyntaxError("Unmatched '(' - needs ')'", groups.back().open);
 fin:
-    if(seq.empty()) has_empty = true; else result.push_back(seq);
-    if(has_empty && !result.empty()) result.push_back(sequence());
-    OptimizeTree(result);
+    OpenGroup& group = groups.back();
+    for(std::size_t a=0; a<group.tasks.size(); ++a)
+        CollectOptimizeTree(*pool, *group.tasks[a]);
+    choices& result = group.Close();
+    if(Current->optimize) OptimizeTree(result);
     return result;
 }
 
-static const std::string EscapeChar(unsigned char c)
-{
-    if(c == '\n') return "\\n";
-    if(c == '\r') return "\\r";
-    if(c == '\t') return "\\t";
-    if(c == '\v') return "\\v";
-    if(c == '\f') return "\\f";
-    if(c == '\a') return "\\a";
-    if(c ==  27)  return "\\e";
-    if(c == '\\') return std::string("\\") + (char)c;
-    if(c < 32) return std::string("\\c") + (char)(c+64);
-    if(c >= 0x20 && c <= 0x7E   ) { return std::string(1,char(c)); }
-    if(c >= 0xA0/*&& c <= 0xFF*/) { return std::string(1,char(c)); }
-    char Buf[64];
+/* Escapes as Perl and PCRE understand them. (There \v means
+ * any vertical space, so the vertical tab is \cK.) */
+static void AppendEscaped(std::string& out, unsigned char c)
+{
+    switch(c)
+    {
+        case '\n': out += "\\n"; return;
+        case '\r': out += "\\r"; return;
+        case '\t': out += "\\t"; return;
+        case '\f': out += "\\f"; return;
+        case '\a': out += "\\a"; return;
+        case  27:  out += "\\e"; return;
+        case '\\': out += "\\\\"; return;
+    }
+    if(c < 32) { out += "\\c"; out += (char)(c+64); return; }
+    if(c >= 0x20 && c <= 0x7E   ) { out += (char)c; return; }
+    if(c >= 0xA0/*&& c <= 0xFF*/) { out += (char)c; return; }
+    char Buf[8];
     std::sprintf(Buf, "\\%03o", c);
-    return Buf;
+    out += Buf;
+}
+
+/* RE2 has no \e or \c, and wants the pattern in ASCII. */
+static void AppendHexEscaped(std::string& out, unsigned char c)
+{
+    switch(c)
+    {
+        case '\n': out += "\\n"; return;
+        case '\r': out += "\\r"; return;
+        case '\t': out += "\\t"; return;
+        case '\v': out += "\\v"; return;
+        case '\f': out += "\\f"; return;
+        case '\a': out += "\\a"; return;
+        case '\\': out += "\\\\"; return;
+    }
+    if(c >= 0x20 && c <= 0x7E) { out += (char)c; return; }
+    char Buf[8];
+    std::sprintf(Buf, "\\x%02X", c);
+    out += Buf;
+}
+
+/* POSIX has no escapes within brackets; bytes stand for themselves. */
+static void AppendRaw(std::string& out, unsigned char c)
+{
+    out += (char)c;
+}
+
+/* A class that a dialect has a name for. */
+struct NamedClass
+{
+    const charset& (*mask)();
+    const char* text;
+    bool brackets; // needs to be within [ ]
+};
+
+/* How a dialect writes charsets. */
+struct Spelling
+{
+    unsigned id;                // of its KeyText cache
+    const NamedClass* classes;  // tried in this order, until a null mask
+    void (*escape)(std::string& out, unsigned char c);
+    const char* any;            // all 256 bytes, if shorter than a bracket
+    bool dot;                   // '.' is everything but '\n'
+    bool posix;                 // no escapes in brackets: ']' first, '-' last,
+                                // and no NUL, for the pattern is a C string
+};
+
+/* [\d] rather than \d, as regex-opt has always printed it. */
+static const NamedClass PerlClasses[] =
+{
+    { GetAsciiMask,  "[:ascii:]",  true  },
+    { GetPrintMask,  "[:print:]",  true  },
+    { GetGraphMask,  "[:graph:]",  true  },
+    { GetWordMask,   "\\w",        false },
+    { GetAlnumMask,  "[:alnum:]",  true  },
+    { GetAlphaMask,  "[:alpha:]",  true  },
+    { GetXdigitMask, "[:xdigit:]", true  },
+    { GetDecMask,    "\\d",        true  },
+    { GetPunctMask,  "[:punct:]",  true  },
+    { GetCntrlMask,  "[:cntrl:]",  true  },
+    { GetSpaceMask,  "[:space:]",  true  },
+    { GetPSpaceMask, "\\s",        false },
+    { 0, 0, false }
+};
+/* In PCRE2 (and Hyperscan, which follows PCRE 8.41), \s includes \v. */
+static const NamedClass PcreClasses[] =
+{
+    { GetAsciiMask,  "[:ascii:]",  true  },
+    { GetPrintMask,  "[:print:]",  true  },
+    { GetGraphMask,  "[:graph:]",  true  },
+    { GetWordMask,   "\\w",        false },
+    { GetAlnumMask,  "[:alnum:]",  true  },
+    { GetAlphaMask,  "[:alpha:]",  true  },
+    { GetXdigitMask, "[:xdigit:]", true  },
+    { GetDecMask,    "\\d",        false },
+    { GetPunctMask,  "[:punct:]",  true  },
+    { GetCntrlMask,  "[:cntrl:]",  true  },
+    { GetSpaceMask,  "\\s",        false },
+    { 0, 0, false }
+};
+static const NamedClass Re2Classes[] =
+{
+    { GetAsciiMask,  "[:ascii:]",  true  },
+    { GetPrintMask,  "[:print:]",  true  },
+    { GetGraphMask,  "[:graph:]",  true  },
+    { GetWordMask,   "\\w",        false },
+    { GetAlnumMask,  "[:alnum:]",  true  },
+    { GetAlphaMask,  "[:alpha:]",  true  },
+    { GetXdigitMask, "[:xdigit:]", true  },
+    { GetDecMask,    "\\d",        false },
+    { GetPunctMask,  "[:punct:]",  true  },
+    { GetCntrlMask,  "[:cntrl:]",  true  },
+    { GetSpaceMask,  "[:space:]",  true  },
+    { GetPSpaceMask, "\\s",        false },
+    { 0, 0, false }
+};
+static const NamedClass PosixClasses[] =
+{
+    { GetPrintMask,  "[:print:]",  true  },
+    { GetGraphMask,  "[:graph:]",  true  },
+    { GetAlnumMask,  "[:alnum:]",  true  },
+    { GetAlphaMask,  "[:alpha:]",  true  },
+    { GetXdigitMask, "[:xdigit:]", true  },
+    { GetDecMask,    "[:digit:]",  true  },
+    { GetPunctMask,  "[:punct:]",  true  },
+    { GetCntrlMask,  "[:cntrl:]",  true  },
+    { GetSpaceMask,  "[:space:]",  true  },
+    { 0, 0, false }
+};
+
+static const Spelling PerlSpelling  = { 0, PerlClasses,  AppendEscaped,    0,        true,  false };
+static const Spelling PcreSpelling  = { 1, PcreClasses,  AppendEscaped,    "(?s:.)", true,  false };
+static const Spelling Re2Spelling   = { 2, Re2Classes,   AppendHexEscaped, "(?s:.)", true,  false };
+static const Spelling PosixSpelling = { 3, PosixClasses, AppendRaw,        ".",      true,  true  };
+static const unsigned NumSpellings = 4;
+
+/* Whether the set includes a named class that contains c,
+ * so that c will be printed as part of it. */
+static bool InNamedClass(const charset& set, const Spelling& sp, unsigned char c)
+{
+    for(const NamedClass* k = sp.classes; k->mask; ++k)
+        if(k->mask()[c] && k->mask().is_subset_of(set))
+            return true;
+    return false;
 }
 
-static void DumpKey(std::ostream& out, const charset& s)
+/* Renders the charset into out, which only grows: when out and
+ * the scratch buffers have enough capacity, nothing is allocated. */
+static void RenderKey(std::string& out, const charset& s, const Spelling& sp)
 {
-    if(s == GetDotMask()) { out << '.'; return; }
+    if(sp.dot && s == GetDotMask()) { out += '.'; return; }
+    if(sp.any && s.all()) { out += sp.any; return; }
     if(s.count() == 1)
     {
-        char c = FindFirst(s);
+        char c = s.first();
         switch(c)
         {
             case '?': case '(': case ')': case '|':
             case '[': case '\\': case '.': case '*':
             case '+': case '{': case '^': case '$': //}
-                out << '\\' << c;
+                out += '\\'; out += c;
                 return;
         }
     }
 
-    std::string result[2];
+    static thread_local std::string result[2];
+    bool brackets[2];
     unsigned size[2];
     for(unsigned flip=0; flip<2; ++flip)
     {
-        std::string sets;
+        std::string& sets = result[flip];
+        sets.clear();
         unsigned n=0;
         bool need_set=false;
 
@@ -1119,54 +3192,54 @@ static void DumpKey(std::ostream& out, const charset& s)
         }
         bool has_circumflex=false;
         bool has_rightbracket=false;
+        bool has_dash=false;
 
         // Put dash ('-') first,
         // unless
         // - It is part of a range
-        // - One of these sets is included (which include '-')
-        //       ascii, graph, print, punct.
+        // - One of the named classes that include it is
+        //   (such as ascii, graph, print, punct).
+        // Within POSIX brackets, ']' must be first, so
+        // the dash goes last instead.
         if(tmp['-']
         && (!tmp['-'-1] || !tmp['-'+1])
-        && !((tmp|GetAsciiMask()) == tmp)
-        && !((tmp|GetGraphMask()) == tmp)
-        && !((tmp|GetPrintMask()) == tmp)
-        && !((tmp|GetPunctMask()) == tmp)
+        && !InNamedClass(tmp, sp, '-')
           )
         {
-            //if(n) sets += '\\';
-            sets += '-'; ++n;
+            if(sp.posix)
+                has_dash = true;
+            else
+                { sets += '-'; ++n; }
             tmp.reset('-');
         }
+        if(sp.posix && tmp[']'] && (!tmp[']'-1] || !tmp[']'+1]))
+        {
+            sets += ']'; ++n;
+            tmp.reset(']');
+            need_set=true;
+        }
 
-    #if 1
-        if((tmp|GetAsciiMask()) == tmp) { ++n;sets += "[:ascii:]"; tmp &= ~GetAsciiMask(); need_set=true; }
-        if((tmp|GetPrintMask()) == tmp) { ++n;sets += "[:print:]"; tmp &= ~GetPrintMask(); need_set=true; }
-        if((tmp|GetGraphMask()) == tmp) { ++n;sets += "[:graph:]"; tmp &= ~GetGraphMask(); need_set=true; }
-
-        if((tmp|GetWordMask()) == tmp)  { ++n;sets += "\\w"; tmp &= ~GetWordMask(); }
-        if((tmp|GetAlnumMask()) == tmp) { ++n;sets += "[:alnum:]"; tmp &= ~GetAlnumMask(); need_set=true; }
-    /**/
-        if((tmp|GetAlphaMask()) == tmp) { ++n;sets += "[:alpha:]"; tmp &= ~GetAlphaMask(); need_set=true; }
-    /*
-        if((tmp|GetLowerMask()) == tmp) { ++n;sets += "[:lower:]"; tmp &= ~GetLowerMask(); need_set=true; }
-        if((tmp|GetUpperMask()) == tmp) { ++n;sets += "[:upper:]"; tmp &= ~GetUpperMask(); need_set=true; }
-    */
-        if((tmp|GetXdigitMask()) == tmp){ ++n;sets += "[:xdigit:]"; tmp &= ~GetXdigitMask(); need_set=true; }
-        if((tmp|GetDecMask()) == tmp)   { ++n;sets += "\\d"; tmp &= ~GetDecMask(); need_set=true; }
-
-        if((tmp|GetPunctMask()) == tmp) { ++n;sets += "[:punct:]"; tmp &= ~GetPunctMask(); need_set=true; }
-        if((tmp|GetCntrlMask()) == tmp) { ++n;sets += "[:cntrl:]"; tmp &= ~GetCntrlMask(); need_set=true; }
-        if((tmp|GetSpaceMask()) == tmp) { ++n;sets += "[:space:]"; tmp &= ~GetSpaceMask(); }
-        if((tmp|GetPSpaceMask()) == tmp){ ++n;sets += "\\s"; tmp &= ~GetPSpaceMask(); }
-    #endif
+        for(const NamedClass* k = sp.classes; k->mask; ++k)
+            if(k->mask().is_subset_of(tmp))
+            {
+                ++n;
+                sets += k->text;
+                tmp &= ~k->mask();
+                if(k->brackets) need_set=true;
+            }
 
         // Second check for '-'. This should be unnecessary.
         if(tmp['-']
         && (!tmp['-'-1] || !tmp['-'+1])
           )
         {
-            if(n) sets += '\\';
-            sets += '-'; ++n;
+            if(sp.posix)
+                has_dash = true;
+            else
+            {
+                if(n) sets += '\\';
+                sets += '-'; ++n;
+            }
             tmp.reset('-');
         }
 
@@ -1175,38 +3248,44 @@ static void DumpKey(std::ostream& out, const charset& s)
             tmp.reset(']');
             has_rightbracket=true;
         }
-        if(tmp['^'] && FindFirst(tmp) == '^' && sets.empty())
+        if(tmp['^'] && tmp.first() == '^' && sets.empty())
         {
             tmp.reset('^');
             has_circumflex=true;
         }
 
         unsigned lower=256, prev=256;
-        for(unsigned a=0; a<=256; ++a)
-            if(a==256 || tmp[a])
+        for(unsigned a=tmp.first(); ; a=tmp.next(a))
+        {
+            if(a != prev+1 || a == 256)
             {
-                if(a != prev+1 || a == 256)
+                if(lower < 256)
                 {
-                    if(lower < 256)
-                    {
-                        n += prev-lower+1;
+                    n += prev-lower+1;
 
-                        sets += EscapeChar(lower);
+                    sp.escape(sets, lower);
 
-                        if(prev > lower+1) { sets += '-'; need_set = true; }
+                    if(prev > lower+1) { sets += '-'; need_set = true; }
 
-                        if(lower != prev)
-                        {
-                            sets += EscapeChar(prev);
-                        }
+                    if(lower != prev)
+                    {
+                        sp.escape(sets, prev);
                     }
-                    lower=a;
                 }
-                prev=a;
+                lower=a;
             }
+            prev=a;
+            if(a == 256) break;
+        }
 
         if(has_circumflex)
         {
+            if(sets.empty() && has_rightbracket)
+            {
+                // [\]^], not [^\]]
+                sets += "\\]"; ++n;
+                has_rightbracket=false;
+            }
             sets += '^';
             ++n;
         }
@@ -1216,108 +3295,999 @@ static void DumpKey(std::ostream& out, const charset& s)
             else sets += "\\]";
             ++n;
         }
+        if(has_dash)
+        {
+            sets += '-';
+            ++n;
+        }
 
-        if(need_set || n > 1) result[flip] += '[';
-        result[flip] += sets;
-        if(need_set || n > 1) result[flip] += ']';
+        brackets[flip] = need_set || n > 1;
         size[flip] = n;
     }
 
     if(size[0]==0 && size[1] > 0) size[0] = 255;
     if(size[1]==0 && size[0] > 0) size[1] = 255;
+    if(sp.posix)
+    {
+        /* The NUL is in the set or in its complement,
+         * unless a named class takes it. */
+        for(unsigned flip=0; flip<2; ++flip)
+            if(result[flip].find('\0') != std::string::npos)
+                size[flip] = ~0u;
+    }
 
-    if(size[0] <= size[1])
-        out << result[0];
-    else
-        out << result[1];
+    unsigned best = size[0] <= size[1] ? 0 : 1;
+    if(brackets[best]) out += '[';
+    out += result[best];
+    if(brackets[best]) out += ']';
 }
 
-static void DumpSequence(std::ostream& out, const sequence& s)
-{
-    for(std::vector<item>::const_iterator
-        i = s.begin(); i != s.end(); ++i)
-    {
-        ParensFlag need_parens = (i->min!=1 || i->max!=1) ? yes_parens : automatic;
+/* Outputs of RenderKey. The same few classes tend to be
+ * printed over and over, so each is rendered only once. */
+static const std::size_t KeyCacheLimit = 4096;
 
-        if(i->tree)
-            DumpTree(out, *i->tree, need_parens);
-        else
-            DumpKey(out, i->ch);
+/* The charset as printed. Valid until the next call. */
+static const std::string& KeyText(const charset& s, const Spelling& sp)
+{
+    static thread_local std::unordered_map<charset, std::string> caches[NumSpellings];
+    std::unordered_map<charset, std::string>& cache = caches[sp.id];
 
-        if(i->min != 1 || i->max != 1)
-        {
-            if(i->max == uinf)
-            {
-                if(i->min == 0) out << '*';
-                else if(i->min == 1) out << '+';
-                else out << '{' << i->min << ",}";
-            }
-            else if(i->min == 0 && i->max == 1)
-            {
-                out << '?';
-            }
-            else
-            {
-                if(i->min == i->max)
-                {
-                    // http looks nicer than ht{2}p
-                    // but [[:xdigit:]]{2} is nicer than [[:xdigit:]][[:xdigit:]]
-                    if(i->min < 3 && !i->tree && i->ch.count() == 1)
-                    {
-                        for(unsigned a=1; a<i->min; ++a) DumpKey(out, i->ch);
-                    }
-                    else
-                        out << '{' << i->min << '}';
-                }
-                else
-                {
-                    out << '{' << i->min << ',' << i->max << '}';
-                }
-            }
-            if(!i->greedy) out << '?';
-        }
+    std::unordered_map<charset, std::string>::const_iterator i = cache.find(s);
+    if(i == cache.end())
+    {
+        if(cache.size() >= KeyCacheLimit) cache.clear();
+        static thread_local std::string buffer;
+        buffer.clear();
+        RenderKey(buffer, s, sp);
+        i = cache.insert(std::make_pair(s, buffer)).first;
     }
+    return i->second;
+}
+static const std::string& KeyText(const charset& s)
+{
+    return KeyText(s, PerlSpelling);
 }
 
-static void DumpTree(std::ostream& out, const choices& c, ParensFlag need_parens)
+regexopt_emitter::~regexopt_emitter()
 {
-    if(need_parens == automatic)
-        need_parens = (ParensFlag)(c.size() != 1);
+}
 
-    if(need_parens) out << "(?:";
+namespace {
+class Emitter: public regexopt_emitter
+{
+public:
+    Emitter(const Spelling& s, const char* g, bool l, bool p, unsigned m)
+        : spelling(s), group(g), lazy(l), possessive(p), max_count(m) { }
 
-    bool first=true;
-    for(choices::const_iterator
-        i = c.begin(); i != c.end(); ++i)
+    virtual void Charset(std::ostream& out, const regexopt_charset& set) const
     {
-        if(first)first=false; else out << '|';
-        DumpSequence(out, *i);
+        const std::string& text = KeyText(set, spelling);
+        out.write(text.data(), text.size());
     }
-    if(need_parens) out << ")";
+    virtual const char* Group() const { return group; }
+    virtual bool Lazy() const { return lazy; }
+    virtual bool Possessive() const { return possessive; }
+    virtual unsigned MaxCount() const { return max_count; }
+
+private:
+    const Spelling& spelling;
+    const char* group;
+    bool lazy, possessive;
+    unsigned max_count;
+};
 }
 
-void DumpRegexOptTree(std::ostream& out, const regexopt_choices& tree)
+/* The counts are the largest that each engine accepts: Perl's
+ * REG_INFTY-1, PCRE2's 65535, RE2's 1000 and POSIX's RE_DUP_MAX.
+ * Hyperscan reports every match, so lazy quantifiers would be
+ * no different from greedy ones; it rejects possessive ones. */
+const regexopt_emitter& RegexOptPerlEmitter()
 {
-    DumpTree(out, tree, (ParensFlag)false);
+    static const Emitter emitter(PerlSpelling, "(?:", true, true, 65534);
+    return emitter;
 }
-
+const regexopt_emitter& RegexOptPcre2Emitter()
+{
+    static const Emitter emitter(PcreSpelling, "(?:", true, true, 65535);
+    return emitter;
+}
+const regexopt_emitter& RegexOptRe2Emitter()
+{
+    static const Emitter emitter(Re2Spelling, "(?:", true, false, 1000);
+    return emitter;
+}
+const regexopt_emitter& RegexOptEreEmitter()
+{
+    static const Emitter emitter(PosixSpelling, "(", false, false, 255);
+    return emitter;
+}
+const regexopt_emitter& RegexOptHyperscanEmitter()
+{
+    static const Emitter emitter(PcreSpelling, "(?:", false, false, 65535);
+    return emitter;
+}
+
+const regexopt_emitter* RegexOptFindEmitter(const std::string& dialect)
+{
+    if(dialect == "perl")      return &RegexOptPerlEmitter();
+    if(dialect == "pcre2")     return &RegexOptPcre2Emitter();
+    if(dialect == "re2")       return &RegexOptRe2Emitter();
+    if(dialect == "ere")       return &RegexOptEreEmitter();
+    if(dialect == "hyperscan") return &RegexOptHyperscanEmitter();
+    return 0;
+}
+
+/* Writes the quantifier for min..max repeats of an atom that has
+ * already been written once. */
+static void DumpCount(std::ostream& out, const item& it, unsigned min, unsigned max,
+                      const regexopt_arena& arena, const regexopt_emitter& syntax)
+{
+    if(min == 1 && max == 1) return;
+    if(min == max && min < 3 && !it.tree && arena.charset(it.ch).count() == 1)
+    {
+        // http looks nicer than ht{2}p
+        // but [[:xdigit:]]{2} is nicer than [[:xdigit:]][[:xdigit:]]
+        for(unsigned a=1; a<min; ++a) syntax.Charset(out, arena.charset(it.ch));
+        return;
+    }
+
+    if(max == uinf)
+    {
+        if(min == 0) out << '*';
+        else if(min == 1) out << '+';
+        else out << '{' << min << ",}";
+    }
+    else if(min == 0 && max == 1)
+        out << '?';
+    else if(min == max)
+        out << '{' << min << '}';
+    else
+        out << '{' << min << ',' << max << '}';
+
+    if(!it.greedy && syntax.Lazy()) out << '?';
+    if(it.possessive && syntax.Possessive()) out << '+';
+}
+
+static void DumpSequence(std::ostream& out, const sequence& s, const regexopt_arena& arena,
+                         const regexopt_emitter& syntax, ItemPositions* where)
+{
+    const unsigned limit = syntax.MaxCount();
+    for(std::vector<item>::const_iterator
+        i = s.begin(); i != s.end(); ++i)
+    {
+        ParensFlag need_parens = (i->min!=1 || i->max!=1) ? yes_parens : automatic;
+        std::size_t begin = where ? (std::size_t)out.tellp() : 0;
+
+        if(i->min <= limit && (i->max == uinf || i->max <= limit))
+        {
+            if(i->tree)
+                DumpTree(out, *i->tree, arena, syntax, need_parens, where);
+            else
+                syntax.Charset(out, arena.charset(i->ch));
+            DumpCount(out, *i, i->min, i->max, arena, syntax);
+        }
+        else
+        {
+            /* Too many for one count: x{min,max} is written
+             * as x{limit} x{min-limit,max-limit}, and so on. */
+            std::ostringstream tmp;
+            if(i->tree)
+                DumpTree(tmp, *i->tree, arena, syntax, need_parens);
+            else
+                syntax.Charset(tmp, arena.charset(i->ch));
+            const std::string atom = tmp.str();
+
+            unsigned min = i->min, max = i->max;
+            for(;;)
+            {
+                out << atom;
+                if(min <= limit && (max == uinf || max <= limit))
+                {
+                    DumpCount(out, *i, min, max, arena, syntax);
+                    break;
+                }
+                if(min > limit)
+                {
+                    DumpCount(out, *i, limit, limit, arena, syntax);
+                    min -= limit;
+                    if(max != uinf) max -= limit;
+                }
+                else
+                {
+                    DumpCount(out, *i, min, limit, arena, syntax);
+                    min = 0;
+                    max -= limit;
+                }
+            }
+        }
+        if(where)
+            where->insert(std::make_pair(&*i, std::make_pair(begin, (std::size_t)out.tellp())));
+    }
+}
+
+static void DumpTree(std::ostream& out, const choices& c, const regexopt_arena& arena,
+                     const regexopt_emitter& syntax, ParensFlag need_parens, ItemPositions* where)
+{
+    if(need_parens == automatic)
+        need_parens = (ParensFlag)(c.size() != 1);
+
+    if(need_parens) out << syntax.Group();
+
+    bool first=true;
+    for(choices::const_iterator
+        i = c.begin(); i != c.end(); ++i)
+    {
+        if(first)first=false; else out << '|';
+        DumpSequence(out, *i, arena, syntax, where);
+    }
+    if(need_parens) out << ")";
+}
+
+void DumpRegexOptTree(std::ostream& out, const regexopt_choices& tree,
+                      const regexopt_arena& arena, const regexopt_emitter& emitter)
+{
+    DumpTree(out, tree, arena, emitter, (ParensFlag)false);
+}
+
+/* Backtracking analysis, for RegexOptGuardBacktracking. */
+
+static bool Nullable(const choices& tree);
+static bool Nullable(const item& it)
+{
+    return it.min == 0 || (it.tree && Nullable(*it.tree));
+}
+static bool Nullable(const sequence& seq)
+{
+    for(sequence::const_iterator i=seq.begin(); i!=seq.end(); ++i)
+        if(!Nullable(*i)) return false;
+    return true;
+}
+static bool Nullable(const choices& tree)
+{
+    for(choices::const_iterator i=tree.begin(); i!=tree.end(); ++i)
+        if(Nullable(*i)) return true;
+    return false;
+}
+
+/* The bytes that a match can begin with. */
+static charset FirstBytes(const choices& tree);
+static charset FirstBytes(const item& it)
+{
+    if(it.max == 0) return charset();
+    return it.tree ? FirstBytes(*it.tree) : Current->arena->charset(it.ch);
+}
+/* ...of what follows seq[from-1]; "open" tells whether it
+ * can be empty, so that what follows the sequence counts too. */
+static charset FirstBytes(const sequence& seq, std::size_t from, bool& open)
+{
+    charset result;
+    for(; from < seq.size(); ++from)
+    {
+        result |= FirstBytes(seq[from]);
+        if(!Nullable(seq[from])) { open = false; return result; }
+    }
+    open = true;
+    return result;
+}
+static charset FirstBytes(const choices& tree)
+{
+    charset result;
+    bool open;
+    for(choices::const_iterator i=tree.begin(); i!=tree.end(); ++i)
+        result |= FirstBytes(*i, 0, open);
+    return result;
+}
+
+/* Whether the item can match different lengths at one position,
+ * so that a backtracking matcher may come back to try another. */
+static bool Variable(const item& it)
+{
+    return it.min != it.max && !it.possessive;
+}
+
+/* (?:x{a,}){b,} matches the same as x{a*b,}, and (?:x*){b,} and
+ * (?:x+)* the same as x*. Returns true if the item was such a
+ * repeat of a repeat, which the matcher could divide in many ways. */
+static bool FlattenNestedRepeat(item& it)
+{
+    if(!it.tree || it.max != uinf || !it.greedy || it.possessive) return false;
+    if(it.tree->size() != 1 || it.tree->begin()->size() != 1) return false;
+    const item& x = (*it.tree->begin())[0];
+    if(x.max != uinf || !x.greedy || x.possessive) return false;
+
+    if(it.min == 0 && x.min >= 2)
+    {
+        it.max = 1; // (?:x{a,})? will do
+        return true;
+    }
+    unsigned long long min = (unsigned long long)x.min * it.min;
+    if(min >= uinf) return false;
+    item result = x;
+    result.min = it.min ? min : 0;
+    it = result;
+    return true;
+}
+
+/* Whether the tree matches strings of one length only,
+ * and in one way only. */
+static bool IsFixedString(const choices& tree)
+{
+    if(tree.size() != 1 || tree.begin()->empty()) return false;
+    const sequence& seq = *tree.begin();
+    for(sequence::const_iterator i=seq.begin(); i!=seq.end(); ++i)
+        if(i->tree || i->min != i->max) return false;
+    return true;
+}
+
+/* Makes possessive the quantifiers that could only give back
+ * bytes that what follows them cannot begin with. A group must
+ * match a fixed string, or giving back within it could matter.
+ * What follows the sequence is not known, so its last items,
+ * and those followed by optional ones only, are left alone. */
+static void GuardTree(choices& tree, std::unordered_set<const choices*>& seen)
+{
+    if(!seen.insert(&tree).second) return;
+    bool changed = false;
+    for(choices::iterator i=tree.begin(); i!=tree.end(); ++i)
+    {
+        sequence& seq = *i;
+        for(std::size_t k=0; k<seq.size(); ++k)
+        {
+            item& it = seq[k];
+            if(it.tree)
+            {
+                GuardTree(*it.tree, seen);
+                if(FlattenNestedRepeat(it)) changed = true;
+            }
+            if(!Variable(it) || !it.greedy) continue;
+            if(it.tree && !IsFixedString(*it.tree)) continue;
+            bool open;
+            charset follow = FirstBytes(seq, k+1, open);
+            if(open || follow.intersects(FirstBytes(it))) continue;
+            it.possessive = true;
+            changed = true;
+        }
+    }
+    if(changed) tree.Changed();
+}
+
+/* The variable items that a match of the tree can end with. */
+static void CollectTails(const choices& tree, std::vector<const item*>& tails)
+{
+    for(choices::const_iterator i=tree.begin(); i!=tree.end(); ++i)
+        for(std::size_t k=i->size(); k-- > 0; )
+        {
+            const item& it = (*i)[k];
+            if(Variable(it))
+                tails.push_back(&it);
+            else if(it.tree && it.max > 0)
+                CollectTails(*it.tree, tails);
+            if(!Nullable(it)) break;
+        }
+}
+
+/* Nested: a repeated group that can end with a variable item which
+ * can also begin the next round, as in (?:a+)+ or (?:\w+\s?)+, can
+ * divide a run of text between its rounds in exponentially many
+ * ways. Adjacent: two repeats that can match the same bytes, as in
+ * \d+\w+, can divide a run between them in polynomially many. */
+static void FindHazards(const choices& tree, std::unordered_set<const choices*>& seen,
+                        std::vector<std::pair<const item*, const char*> >& hazards)
+{
+    if(!seen.insert(&tree).second) return;
+    for(choices::const_iterator i=tree.begin(); i!=tree.end(); ++i)
+        for(std::size_t k=0; k<i->size(); ++k)
+        {
+            const item& it = (*i)[k];
+            if(k+1 < i->size())
+            {
+                const item& next = (*i)[k+1];
+                if(!it.tree && !next.tree && it.max > 1 && next.max > 1
+                && Variable(it) && Variable(next)
+                && FirstBytes(it).intersects(FirstBytes(next)))
+                    hazards.push_back(std::make_pair(&it,
+                        "adjacent quantifiers can divide the same text in many ways"));
+            }
+            if(!it.tree) continue;
+            if(it.max > 1 && !it.possessive)
+            {
+                std::vector<const item*> tails;
+                CollectTails(*it.tree, tails);
+                charset first = FirstBytes(*it.tree);
+                for(std::size_t t=0; t<tails.size(); ++t)
+                    if(FirstBytes(*tails[t]).intersects(first))
+                    {
+                        hazards.push_back(std::make_pair(&it,
+                            "nested quantifiers can divide the same text in many ways"));
+                        break;
+                    }
+            }
+            FindHazards(*it.tree, seen, hazards);
+        }
+}
+
+std::vector<regexopt_backtracking_warning>
+    RegexOptGuardBacktracking(regexopt_choices& tree, regexopt_arena& arena,
+                              const regexopt_emitter& emitter)
+{
+    regexopt_options options;
+    ContextScope scope(arena, options);
+
+    std::unordered_set<const choices*> seen;
+    GuardTree(tree, seen);
+
+    std::vector<std::pair<const item*, const char*> > hazards;
+    seen.clear();
+    FindHazards(tree, seen, hazards);
+
+    std::vector<regexopt_backtracking_warning> result;
+    if(hazards.empty()) return result;
+
+    ItemPositions where;
+    std::ostringstream out;
+    DumpTree(out, tree, arena, emitter, (ParensFlag)false, &where);
+    for(std::size_t a=0; a<hazards.size(); ++a)
+    {
+        const std::pair<std::size_t, std::size_t>& p = where[hazards[a].first];
+        regexopt_backtracking_warning w = { p.first, p.second - p.first, hazards[a].second };
+        result.push_back(w);
+    }
+    struct local
+    {
+        static bool Before(const regexopt_backtracking_warning& a,
+                           const regexopt_backtracking_warning& b)
+        {
+            return a.position < b.position;
+        }
+    };
+    std::stable_sort(result.begin(), result.end(), local::Before);
+    return result;
+}
+
+std::string DescribeRegexOptWarning(const regexopt_backtracking_warning& warning,
+                                    const std::string& printed)
+{
+    static const std::size_t MaxQuote = 60;
+    std::ostringstream out;
+    out << "offset " << warning.position << ": " << warning.reason << ": ";
+    if(warning.length <= MaxQuote)
+        out << printed.substr(warning.position, warning.length);
+    else
+        out << printed.substr(warning.position, MaxQuote-3) << "...";
+    return out.str();
+}
+
+regexopt_cost_model::~regexopt_cost_model()
+{
+}
+
+namespace {
+class SizeCost: public regexopt_cost_model
+{
+public:
+    virtual double Cost(const regexopt_cost_features& f) const
+    {
+        return f.length;
+    }
+};
+
+/* Roughly in units of one byte test. A branch pushes and pops a
+ * backtracking point; a quantified group also saves its count.
+ * The sparser the first bytes, the more positions are skipped
+ * without trying. The length only breaks ties. */
+class SpeedCost: public regexopt_cost_model
+{
+public:
+    virtual double Cost(const regexopt_cost_features& f) const
+    {
+        return f.tests + 2*f.branches + 4*f.nesting + 2*f.selectivity
+             + f.length / 1000;
+    }
+};
+}
+
+const regexopt_cost_model& RegexOptSizeCost()
+{
+    static const SizeCost model;
+    return model;
+}
+
+const regexopt_cost_model& RegexOptSpeedCost()
+{
+    static const SpeedCost model;
+    return model;
+}
+
+#ifdef REGEXOPT_STATS
+const bool regexopt_stats::enabled = true;
+#else
+const bool regexopt_stats::enabled = false;
+#endif
+
+const char* regexopt_stats::name(pass p)
+{
+    static const char* const names[num_passes] =
+    {
+        "OptimizeTree", "FlattenTree", "CharsetCombineTree", "CombineTree",
+        "CountingCombineTree", "SubsumeTree", "HeavyCompressSequence",
+        "FlattenSequence", "CompressSequence"
+    };
+    return names[p];
+}
+
+void regexopt_stats::Clear()
+{
+    for(unsigned p=0; p<num_passes; ++p)
+    {
+        counters& c = passes[p];
+        c.calls = c.iterations = c.nodes = c.rewrites = 0;
+        c.seconds = 0;
+    }
+}
+
+regexopt_stats& regexopt_stats::operator+= (const regexopt_stats& b)
+{
+    for(unsigned p=0; p<num_passes; ++p)
+    {
+        counters& c = passes[p];
+        const counters& d = b.passes[p];
+        c.calls      += d.calls;
+        c.iterations += d.iterations;
+        c.nodes      += d.nodes;
+        c.rewrites   += d.rewrites;
+        c.seconds    += d.seconds;
+    }
+    return *this;
+}
+
+void DumpRegexOptStats(std::ostream& out, const regexopt_stats& stats, bool json)
+{
+    std::ios::fmtflags flags = out.flags();
+    std::streamsize precision = out.precision();
+    out.setf(std::ios::fixed);
+    out.precision(3);
+
+    double total = 0;
+    for(unsigned p=0; p<regexopt_stats::num_passes; ++p)
+        total += stats.passes[p].seconds;
+
+    if(json)
+    {
+        out << "{\"passes\":[";
+        for(unsigned p=0; p<regexopt_stats::num_passes; ++p)
+        {
+            const regexopt_stats::counters& c = stats.passes[p];
+            out << (p ? "," : "")
+                << "{\"pass\":\"" << regexopt_stats::name((regexopt_stats::pass)p) << "\""
+                << ",\"calls\":"      << c.calls
+                << ",\"iterations\":" << c.iterations
+                << ",\"nodes\":"      << c.nodes
+                << ",\"rewrites\":"   << c.rewrites
+                << ",\"time_ms\":"    << c.seconds * 1e3
+                << "}";
+        }
+        out << "],\"total_ms\":" << total * 1e3 << "}\n";
+    }
+    else
+    {
+        out << std::left << std::setw(22) << "pass" << std::right
+            << std::setw(12) << "calls"
+            << std::setw(12) << "iterations"
+            << std::setw(14) << "nodes"
+            << std::setw(12) << "rewrites"
+            << std::setw(12) << "time ms"
+            << std::setw(8)  << "%" << '\n';
+        for(unsigned p=0; p<regexopt_stats::num_passes; ++p)
+        {
+            const regexopt_stats::counters& c = stats.passes[p];
+            out << std::left << std::setw(22) << regexopt_stats::name((regexopt_stats::pass)p)
+                << std::right
+                << std::setw(12) << c.calls
+                << std::setw(12) << c.iterations
+                << std::setw(14) << c.nodes
+                << std::setw(12) << c.rewrites
+                << std::setw(12) << c.seconds * 1e3
+                << std::setw(8)  << std::setprecision(1)
+                << (total > 0 ? c.seconds * 100 / total : 0.0)
+                << std::setprecision(3) << '\n';
+        }
+        out << std::left << std::setw(72) << "total" << std::right
+            << std::setw(12) << total * 1e3 << '\n';
+    }
+
+    out.flags(flags);
+    out.precision(precision);
+}
+
 static void TestSet(const std::string& s)
 {
     unsigned a=0;
-    charset tmp = ParseCharSet("[" + s + "]", a);
+    const std::string set = "[" + s + "]";
+    charset tmp = ParseCharSet(set.data(), set.size(), a);
 
     std::cout << "[" << s << "](" << a << "):";
 
-    for(unsigned a=0; a<256; ++a)
+    for(unsigned a=tmp.first(); a<256; a=tmp.next(a))
+        std::cout << (char)a;
+
+    std::cout << std::endl;
+}
+
+/* Positions are unsigned, so that is the longest regexp. */
+static unsigned RegexpLength(std::size_t length)
+{
+    if(length >= uinf) throw "Regexp too long";
+    return length;
+}
+
+const regexopt_choices RegexOptParse(const char* s, std::size_t length, unsigned& pos,
+                                     regexopt_arena& arena,
+                                     const regexopt_options& options)
+{
+    ContextScope scope(arena, options);
+
+    return Parse(s, RegexpLength(length), pos);
+}
+
+const regexopt_choices RegexOptParse(const std::string& s, unsigned& pos,
+                                     regexopt_arena& arena,
+                                     const regexopt_options& options)
+{
+    return RegexOptParse(s.data(), s.size(), pos, arena, options);
+}
+
+const regexopt_choices RegexOptParseOnly(const char* s, std::size_t length, unsigned& pos,
+                                         regexopt_arena& arena)
+{
+    regexopt_options options;
+    ContextScope scope(arena, options);
+    scope.context.optimize = false;
+
+    return Parse(s, RegexpLength(length), pos);
+}
+
+const regexopt_choices RegexOptParseOnly(const std::string& s, unsigned& pos,
+                                         regexopt_arena& arena)
+{
+    return RegexOptParseOnly(s.data(), s.size(), pos, arena);
+}
+
+void RegexOptOptimize(regexopt_choices& tree,
+                      regexopt_arena& arena,
+                      const regexopt_options& options)
+{
+    ContextScope scope(arena, options);
+
+    OptimizeTree(tree);
+}
+
+/* Freezes the tree and all the trees under it. */
+static void FreezeTree(choices* tree)
+{
+    std::vector<choices*> pending(1, tree);
+    while(!pending.empty())
     {
-        if(tmp[a])
-            std::cout << (char)a;
+        choices* t = pending.back();
+        pending.pop_back();
+        if(t->frozen()) continue;
+        t->Freeze();
+        for(choices::const_iterator i = t->begin(); i != t->end(); ++i)
+            for(sequence::const_iterator j = i->begin(); j != i->end(); ++j)
+                if(j->tree) pending.push_back(j->tree);
     }
+}
 
-    std::cout << std::endl;
+/* What has been worked out about a state of the DAWG: its
+ * immediate post-dominator, its depth in the post-dominator tree,
+ * and (when memoizing) the expansion of the paths from it up to
+ * the post-dominator. The entry is valid for as long as the
+ * serial number of the state stays the same. */
+struct WordListState
+{
+    unsigned long long serial; // 0 = nothing known
+    unsigned ipdom;
+    unsigned depth;
+    bool expanded;
+    sequence branch;
+
+    WordListState(): serial(0), ipdom(0), depth(0), expanded(false), branch() { }
+};
+typedef std::vector<WordListState> WordListCache;
+
+/* Converts a minimal acyclic automaton into a tree.
+ *
+ * Each state is given its immediate post-dominator: the first
+ * state that every path from it to an accepting end must pass
+ * through (with a virtual "end" state after all final states).
+ * The paths from a state up to its post-dominator form one group
+ * of alternatives, and the rest of the match is the post-dominator's
+ * own expansion. This way the shared suffixes of the DAWG are
+ * written only once, e.g. "xyzing|abcing" gives (?:xyz|abc)ing,
+ * and edges leading to the same state become a character set.
+ *
+ * Both depend only on the states reachable from the state, so
+ * when the DAWG changes, the cache keeps what is still valid.
+ * When memoizing, the expansions are kept too (and frozen, for
+ * they are shared), so only the changed states are expanded.
+ */
+class WordListConverter
+{
+    const regexopt_dawg& dawg;
+    WordListCache& cache;
+    const bool memoize;
+    const unsigned end;          // the virtual end state
+
+    bool Known(unsigned s) const { return cache[s].serial == dawg[s].serial; }
+    unsigned Ipdom(unsigned s) const { return s == end ? end : cache[s].ipdom; }
+    unsigned Depth(unsigned s) const { return s == end ? 0 : cache[s].depth; }
+
+    unsigned Intersect(unsigned a, unsigned b) const
+    {
+        while(a != b)
+        {
+            while(Depth(a) > Depth(b)) a = Ipdom(a);
+            while(Depth(b) > Depth(a)) b = Ipdom(b);
+            if(a != b) { a = Ipdom(a); b = Ipdom(b); }
+        }
+        return a;
+    }
+
+    void ComputePostDominators()
+    {
+        if(cache.size() < dawg.limit()) cache.resize(dawg.limit());
+        if(Known(dawg.root())) return;
+
+        /* Depth-first postorder visits the successors before
+         * the state itself, which is what the dominator
+         * intersection needs. No recursion: words may be long. */
+        std::vector<std::pair<unsigned, unsigned> > stack; // state, next edge
+        stack.push_back(std::make_pair(dawg.root(), 0u));
+        while(!stack.empty())
+        {
+            unsigned s = stack.back().first;
+            const regexopt_dawg::state& st = dawg[s];
+            if(stack.back().second < st.edges.size())
+            {
+                unsigned t = st.edges[stack.back().second++].target;
+                if(!Known(t)) stack.push_back(std::make_pair(t, 0u));
+                continue;
+            }
+            stack.pop_back();
+
+            unsigned dom = st.final ? end : uinf;
+            for(unsigned e=0; e<st.edges.size(); ++e)
+            {
+                unsigned t = st.edges[e].target;
+                dom = (dom == uinf) ? t : Intersect(dom, t);
+            }
+            if(dom == uinf) dom = end; // only the root can be a dead end
+
+            WordListState& c = cache[s];
+            c.serial   = st.serial;
+            c.ipdom    = dom;
+            c.depth    = Depth(dom) + 1;
+            c.expanded = false;
+            sequence().swap(c.branch);
+        }
+    }
+
+    /* Appends the expansion of all paths from s to stop. */
+    void AppendPath(unsigned s, unsigned stop, sequence& seq)
+    {
+        while(s != stop)
+        {
+            unsigned p = Ipdom(s);
+            AppendBranch(s, p, seq);
+            s = p;
+        }
+    }
+
+    /* Appends the alternatives between s and its post-dominator p. */
+    void AppendBranch(unsigned s, unsigned p, sequence& seq)
+    {
+        if(!memoize) { ExpandBranch(s, p, seq); return; }
+
+        WordListState& c = cache[s];
+        if(!c.expanded)
+        {
+            ExpandBranch(s, p, c.branch);
+            for(sequence::const_iterator i = c.branch.begin(); i != c.branch.end(); ++i)
+                if(i->tree) FreezeTree(i->tree);
+            c.expanded = true;
+        }
+        seq.insert(seq.end(), c.branch.begin(), c.branch.end());
+    }
+
+    void ExpandBranch(unsigned s, unsigned p, sequence& seq)
+    {
+        const regexopt_dawg::state& st = dawg[s];
+
+        /* Group the edges by their target. */
+        std::vector<std::pair<unsigned, charset> > groups;
+        for(unsigned e=0; e<st.edges.size(); ++e)
+        {
+            unsigned g=0, t = st.edges[e].target;
+            while(g < groups.size() && groups[g].first != t) ++g;
+            if(g == groups.size()) groups.push_back(std::make_pair(t, charset()));
+            groups[g].second.set(st.edges[e].ch);
+        }
+
+        /* A final state with outgoing edges makes the group optional. */
+        bool has_empty = st.final && p == end;
+
+        if(groups.size() == 1 && !has_empty)
+        {
+            item it;
+            it.ch = InternCharset(groups[0].second);
+            seq.push_back(it);
+            AppendPath(groups[0].first, p, seq);
+            return;
+        }
+        if(groups.empty()) return;
+
+        item it;
+        it.tree = NewChoices();
+        for(unsigned g=0; g<groups.size(); ++g)
+        {
+            sequence alt;
+            item first;
+            first.ch = InternCharset(groups[g].second);
+            alt.push_back(first);
+            AppendPath(groups[g].first, p, alt);
+            it.tree->push_back(alt);
+        }
+        if(has_empty) it.min = 0;
+        it.Optimize();
+        seq.push_back(it);
+    }
+
+public:
+    WordListConverter(const regexopt_dawg& d, WordListCache& c, bool memo)
+        : dawg(d), cache(c), memoize(memo), end(uinf - 1)
+    {
+    }
+
+    const choices Convert()
+    {
+        choices result;
+        if(!dawg.words()) return result;
+        ComputePostDominators();
+
+        sequence seq;
+        AppendPath(dawg.root(), end, seq);
+        if(!seq.empty()) result.push_back(seq);
+        OptimizeTree(result);
+        return result;
+    }
+};
+
+const regexopt_choices RegexOptWordList(const regexopt_dawg& words,
+                                        regexopt_arena& arena,
+                                        const regexopt_options& options)
+{
+    ContextScope scope(arena, options);
+
+    WordListCache cache;
+    return WordListConverter(words, cache, false).Convert();
+}
+
+struct regexopt_incremental::state_cache
+{
+    WordListCache states;
+};
+
+/* Unused nodes may pile up in the arena to this many
+ * (plus the size after the last rebuild) before Result()
+ * rebuilds everything to free them. */
+static const std::size_t IncrementalSlack = 4096;
+
+regexopt_incremental::regexopt_incremental(const regexopt_options& o)
+    : options(o), dawg(), nodes(), parsed(), cache(new state_cache),
+      result(), stale(false), damaged(false), base(0)
+{
+    dawg.Finish();
+}
+
+regexopt_incremental::~regexopt_incremental()
+{
+    delete cache;
+}
+
+bool regexopt_incremental::AddWord(const std::string& word)
+{
+    if(!dawg.Insert(word)) return false;
+    stale = true;
+    return true;
 }
 
-const regexopt_choices RegexOptParse(const std::string& s, unsigned& pos)
+bool regexopt_incremental::RemoveWord(const std::string& word)
 {
-    return Parse(s, pos);
+    if(!dawg.Erase(word)) return false;
+    stale = true;
+    return true;
+}
+
+bool regexopt_incremental::AddRegex(const std::string& regex)
+{
+    if(parsed.find(regex) != parsed.end()) return false;
+    regexopt_choices tree;
+    Parse(regex, tree);
+    parsed[regex].swap(tree);
+    stale = true;
+    return true;
+}
+
+bool regexopt_incremental::RemoveRegex(const std::string& regex)
+{
+    if(!parsed.erase(regex)) return false;
+    stale = true;
+    return true;
+}
+
+/* Optimizes one regexp and freezes its subtrees. */
+void regexopt_incremental::Parse(const std::string& regex, regexopt_choices& tree)
+{
+    bool partial = false;
+    regexopt_options o = options;
+    o.partial = &partial;
+    unsigned pos = 0;
+    tree = RegexOptParse(regex, pos, nodes, o);
+    if(options.partial) *options.partial = partial;
+    if(partial) damaged = true;
+
+    for(choices::const_iterator i = tree.begin(); i != tree.end(); ++i)
+        for(sequence::const_iterator j = i->begin(); j != i->end(); ++j)
+            if(j->tree) FreezeTree(j->tree);
+}
+
+void regexopt_incremental::Compute()
+{
+    bool partial = false;
+    regexopt_options o = options;
+    o.partial = &partial;
+    {
+        ContextScope scope(nodes, o);
+
+        result = WordListConverter(dawg, cache->states, true).Convert();
+        if(!parsed.empty())
+        {
+            choices all(result);
+            for(std::map<std::string, regexopt_choices>::const_iterator
+                i = parsed.begin(); i != parsed.end(); ++i)
+            {
+                for(choices::const_iterator j = i->second.begin(); j != i->second.end(); ++j)
+                    all.push_back(*j);
+            }
+            OptimizeTree(all);
+            result.swap(all);
+        }
+    }
+    if(options.partial) *options.partial = partial;
+    if(partial) damaged = true;
+    stale = false;
+}
+
+const regexopt_choices& regexopt_incremental::Result()
+{
+    if(damaged || nodes.nodes() > 2*base + IncrementalSlack)
+        Rebuild();
+    else if(stale)
+        Compute();
+    return result;
+}
+
+void regexopt_incremental::Rebuild()
+{
+    result.clear();
+    nodes.Clear();
+    cache->states.clear();
+    damaged = false;
+
+    for(std::map<std::string, regexopt_choices>::iterator
+        i = parsed.begin(); i != parsed.end(); ++i)
+    {
+        Parse(i->first, i->second);
+    }
+    Compute();
+    base = nodes.nodes();
 }
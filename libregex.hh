@@ -1,38 +1,294 @@
+#ifndef bqtLibRegexHH
+#define bqtLibRegexHH
+
 #include <vector>
-#include <list>
-#include <bitset>
+#include <iterator>
+#include <deque>
+#include <unordered_map>
+#include <string>
 #include <ostream>
+#include <cstddef>
+#include "charset.hh"
 
 ///////////////////////
 
-typedef std::bitset<256> regexopt_charset;
 typedef std::vector<struct regexopt_item> regexopt_sequence;
-typedef std::list<regexopt_sequence> regexopt_choices;
+struct regexopt_choices;
+
+class regexopt_arena;
+class regexopt_dawg;
+struct regexopt_stats;
+class regexopt_cost_model;
+
+/* Tunables of the optimizer. */
+struct regexopt_options
+{
+    /* Longest block (in items) that HeavyCompressSequence tries
+     * to find repeated, as in (?:xyz){n}. 0 means no limit.
+     * Lowering this speeds up very long sequences. */
+    unsigned repeat_window;
+
+    /* Share one node between all structurally identical subtrees,
+     * so that they compare equal by pointer. Saves comparison time
+     * and memory when the input repeats the same groups a lot. */
+    bool intern_subtrees;
+
+    /* If not null, the work done by each optimizer pass is added
+     * to these counters. Not shared between threads: give each
+     * thread its own. See regexopt_stats. */
+    regexopt_stats* stats;
+
+    /* Budget of one call (RegexOptParse, RegexOptOptimize or
+     * RegexOptWordList), in wall time and in optimizer steps (rounds
+     * of the rewriting loops). 0 means no limit. When the budget
+     * runs out, the optimizer stops where it is: the result is a
+     * valid regexp equivalent to the input, only less optimized. */
+    double time_limit;             // seconds
+    unsigned long long step_limit;
+
+    /* If not null, set to whether the budget ran out. */
+    bool* partial;
+
+    /* If not null, the rewrites of CombineTree, CountingCombineTree
+     * and HeavyCompressSequence are only made when they do not raise
+     * the cost estimated by this model. Otherwise they are chosen by
+     * structure alone. See regexopt_cost_model. */
+    const regexopt_cost_model* cost_model;
+
+    /* Threads for optimizing independent subtrees in parallel:
+     * 1 works on the calling thread only, 0 uses one per CPU. The
+     * result is the same for any number. RegexOptParse hands large
+     * groups to the other threads as it closes them. Nothing is done
+     * in parallel under a budget (the steps would be taken in another
+     * order) or with intern_subtrees (the table is shared). */
+    unsigned threads;
+
+    regexopt_options()
+        : repeat_window(0), intern_subtrees(false), stats(0),
+          time_limit(0), step_limit(0), partial(0), cost_model(0),
+          threads(1) { }
+};
+
+/* What the optimizer estimates about a part of a regexp when it
+ * weighs a rewrite. Except for the length, these are expected
+ * values for one attempt of a backtracking matcher to match at
+ * one position of an input where all byte values are equally
+ * likely: an attempt stops at the first byte that fails.
+ */
+struct regexopt_cost_features
+{
+    double length;      // characters of the printed regexp
+    double tests;       // bytes tested against a charset
+    double branches;    // alternatives tried
+    double nesting;     // iterations of quantified groups; nested
+                        // quantifiers multiply these
+    double selectivity; // fraction of the byte values that can
+                        // begin a match (1 if it can be empty)
+};
+
+/* Turns the features into the one figure that the optimizer
+ * keeps from growing. Derive from this for other objectives. */
+class regexopt_cost_model
+{
+public:
+    virtual ~regexopt_cost_model();
+    virtual double Cost(const regexopt_cost_features& f) const = 0;
+};
+
+/* The built-in models: the length of the result, and the time
+ * taken by a backtracking matcher (which skips the positions
+ * where the first byte cannot begin a match). */
+const regexopt_cost_model& RegexOptSizeCost();
+const regexopt_cost_model& RegexOptSpeedCost();
+
+/* Counters of the optimizer passes, for finding out where
+ * the time goes. They are only collected when the library is
+ * compiled with REGEXOPT_STATS defined; otherwise "enabled" is
+ * false, the passes carry no instrumentation at all, and the
+ * counters are left at zero.
+ *
+ * The time of a pass excludes the passes nested in it (such
+ * as the subtrees optimized by CombineTree), so the times of
+ * all passes add up to the total.
+ */
+struct regexopt_stats
+{
+    enum pass
+    {
+        optimize_tree,          // the fixpoint loop of OptimizeTree itself
+        flatten_tree,
+        charset_combine_tree,
+        combine_tree,
+        counting_combine_tree,
+        subsume_tree,
+        heavy_compress_sequence,
+        flatten_sequence,
+        compress_sequence,
+        num_passes
+    };
+    struct counters
+    {
+        unsigned long long calls;      // invocations
+        unsigned long long iterations; // rounds of fixpoint loops
+        unsigned long long nodes;      // alternatives or items examined
+        unsigned long long rewrites;   // changes applied
+        double seconds;                // wall time, nested passes excluded
+    };
+    counters passes[num_passes];
+
+    static const bool enabled;
+    static const char* name(pass p);
+
+    regexopt_stats() { Clear(); }
+    void Clear();
+    regexopt_stats& operator+= (const regexopt_stats& b);
+};
+
+/* Prints the counters as a table, or as one line of JSON. */
+void DumpRegexOptStats(std::ostream& out, const regexopt_stats& stats, bool json);
+
+/* Parses and optimizes the regexp. All subtrees referred to
+ * by the returned tree are owned by the given arena, so the
+ * arena must outlive the result.
+ *
+ * Parsing stops at the end of the regexp, or at a ')' that
+ * closes nothing, and leaves pos there. A syntax error is thrown
+ * as a std::string that ends with " at byte <offset>".
+ *
+ * The regexp may also be given as a pointer and a length,
+ * such as a record within a larger buffer; it is not copied.
+ */
+const regexopt_choices RegexOptParse(const std::string& s, unsigned& pos,
+                                     regexopt_arena& arena,
+                                     const regexopt_options& options = regexopt_options());
+const regexopt_choices RegexOptParse(const char* s, std::size_t length, unsigned& pos,
+                                     regexopt_arena& arena,
+                                     const regexopt_options& options = regexopt_options());
+
+/* The two halves of RegexOptParse, for callers that want to
+ * look at or time them separately: parsing only, and optimizing
+ * a parsed tree in place. The result is the same as that of
+ * RegexOptParse.
+ */
+const regexopt_choices RegexOptParseOnly(const std::string& s, unsigned& pos,
+                                         regexopt_arena& arena);
+const regexopt_choices RegexOptParseOnly(const char* s, std::size_t length, unsigned& pos,
+                                         regexopt_arena& arena);
+void RegexOptOptimize(regexopt_choices& tree,
+                      regexopt_arena& arena,
+                      const regexopt_options& options = regexopt_options());
+
+/* Builds the tree matching exactly the words of a finished
+ * regexopt_dawg (see dawg.hh). Runs in time roughly linear in
+ * the size of the automaton, instead of parsing and combining
+ * a huge alternation of literals. */
+const regexopt_choices RegexOptWordList(const regexopt_dawg& words,
+                                        regexopt_arena& arena,
+                                        const regexopt_options& options = regexopt_options());
+
+/* Spells the tree in the syntax of one regexp dialect. Each picks
+ * the shortest of the constructs that its dialect has: named classes,
+ * escapes, groups and counts. The quantifiers that a dialect lacks
+ * are written as greedy ones, which match the same strings (where
+ * the dialect is one whose matches are all reported, or leftmost-
+ * longest, nothing else changes either).
+ */
+class regexopt_emitter
+{
+public:
+    virtual ~regexopt_emitter();
+
+    /* Writes the charset as one atom. */
+    virtual void Charset(std::ostream& out, const regexopt_charset& set) const = 0;
+
+    /* Opens a group; ")" closes it. */
+    virtual const char* Group() const = 0;
+
+    virtual bool Lazy() const = 0;       // x*? can be written
+    virtual bool Possessive() const = 0; // x*+ can be written
+
+    /* The largest count in braces. Larger repeats are split,
+     * as in x{1000}x{500}. */
+    virtual unsigned MaxCount() const = 0;
+};
+
+/* The built-in dialects:
+ *   Perl:  the default, and what earlier versions printed; \s is
+ *          taken to exclude \v, as in Perl before 5.18.
+ *   PCRE2: as Perl, but with \s as [\t\n\v\f\r ].
+ *   RE2:   no \e, \c or possessive quantifiers; bytes above 0x7F
+ *          are escaped, and mean bytes with the Latin-1 option.
+ *   ERE:   POSIX extended, in the C locale; ( ) groups, no class
+ *          escapes, and bytes that cannot be escaped are raw.
+ *          The result is meant for line-based matching (grep -E,
+ *          or regcomp with REG_NEWLINE), where '.' is Perl's '.'.
+ *          A literal '\n' would have to be raw too, which grep -E
+ *          and line-based output take as a separator, so regex-opt
+ *          reports such a result as an error.
+ *   Hyperscan: as PCRE2, without lazy or possessive quantifiers.
+ */
+const regexopt_emitter& RegexOptPerlEmitter();
+const regexopt_emitter& RegexOptPcre2Emitter();
+const regexopt_emitter& RegexOptRe2Emitter();
+const regexopt_emitter& RegexOptEreEmitter();
+const regexopt_emitter& RegexOptHyperscanEmitter();
+
+/* By name: "perl", "pcre2", "re2", "ere" or "hyperscan".
+ * Returns 0 for an unknown dialect. */
+const regexopt_emitter* RegexOptFindEmitter(const std::string& dialect);
+
+/* Prints the tree as a regexp. The arena is the one
+ * the tree was built in; it holds the charsets. */
+void DumpRegexOptTree(std::ostream& out, const regexopt_choices& tree,
+                      const regexopt_arena& arena,
+                      const regexopt_emitter& emitter = RegexOptPerlEmitter());
+
+/* A part of the printed tree where a backtracking matcher (such
+ * as PCRE) may take time exponential or polynomial in the length
+ * of the input, because the quantifiers there can divide the same
+ * text between them in many ways. */
+struct regexopt_backtracking_warning
+{
+    std::size_t position; // offset in the output of DumpRegexOptTree
+                          // with the same emitter
+    std::size_t length;
+    const char* reason;
+};
 
-const regexopt_choices RegexOptParse(const std::string& s, unsigned& pos);
+/* Removes the needless backtracking from an optimized tree: makes
+ * the quantifiers possessive, as in "[a-z]++\d", where giving back
+ * what they matched could not lead to a match, and turns repeats of
+ * repeats such as (?:a+)+ into single ones. The strings matched stay
+ * the same. Returns the ambiguous nested or adjacent quantifiers
+ * that remain, in the order of their positions.
+ *
+ * The optimizer does not understand possessive quantifiers, so this
+ * must be the last step before printing.
+ */
+std::vector<regexopt_backtracking_warning>
+    RegexOptGuardBacktracking(regexopt_choices& tree, regexopt_arena& arena,
+                              const regexopt_emitter& emitter = RegexOptPerlEmitter());
 
-void DumpRegexOptTree(std::ostream& out, const regexopt_choices& tree);
+/* "offset N: reason: part", quoting the part from the printed tree. */
+std::string DescribeRegexOptWarning(const regexopt_backtracking_warning& warning,
+                                    const std::string& printed);
 
 //////////////////////
 
 struct regexopt_item
 {
-    regexopt_choices* tree;
-    regexopt_charset ch; // used if tree is 0.
+    regexopt_choices* tree; // owned by a regexopt_arena
+    unsigned ch; // used if tree is 0: id of a charset interned in the arena
 
     unsigned min;
     unsigned max;
     bool greedy;
+    bool possessive; // never gives back; only set by RegexOptGuardBacktracking
     // bool bol;
     // bool eol;
 
-    regexopt_item(): tree(0),ch(),min(1),max(1),greedy(true)
-    {
-    }
-
-    ~regexopt_item()
+    regexopt_item(): tree(0),ch(0),min(1),max(1),greedy(true),possessive(false)
     {
-        //if(tree) delete tree;
     }
 
     /* Standard comparisons: Compare whether two instances
@@ -43,9 +299,16 @@ struct regexopt_item
     /* Like operator==, but ignores min and max. */
     bool is_equal(const regexopt_item& b) const;
 
+    /* Structural hash: equal items have equal hashes. */
+    std::size_t hash() const;
+
     /* Check whether this node is redundant in the presence
-     * of the comparison node. */
-    bool is_subset_of(const regexopt_item& b) const; // Not implemented. TODO.
+     * of the comparison node: whether b matches every string
+     * that this one matches. Exact for charsets and for counts
+     * of the same item; other items are compared as automata,
+     * and where those would be too large, the answer is false.
+     * The arena is the one that holds the charsets. */
+    bool is_subset_of(const regexopt_item& b, const regexopt_arena& arena) const;
 
     void Optimize();
 //private:
@@ -53,10 +316,195 @@ struct regexopt_item
 //    item(const regexopt_item);
 };
 
+/* The alternatives of a subexpression, stored contiguously.
+ *
+ * Iterators are indexes, so push_back() does not invalidate
+ * them, and erase() only marks the slot dead: a pass may keep
+ * handles to several alternatives while it erases and appends
+ * others. Dead slots are skipped when iterating, and squeezed
+ * out by Compact(), which does invalidate the iterators.
+ *
+ * The list also remembers the structural hash of its contents
+ * once it is computed, so comparisons of unequal subtrees are
+ * usually decided without walking them. Whoever modifies a list
+ * that may already have been hashed or optimized must call Changed().
+ */
+struct regexopt_choices
+{
+private:
+    struct slot
+    {
+        regexopt_sequence seq;
+        bool dead;
+    };
+
+    template<typename Owner, typename Value>
+    class basic_iterator
+    {
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef regexopt_sequence value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef Value* pointer;
+        typedef Value& reference;
+
+        basic_iterator(): owner(0), index(0) { }
+        basic_iterator(Owner* o, std::size_t i): owner(o), index(i) { }
+        /* iterator -> const_iterator */
+        template<typename O, typename V>
+        basic_iterator(const basic_iterator<O,V>& b): owner(b.owner), index(b.index) { }
+
+        Value& operator* () const { return owner->slots[index].seq; }
+        Value* operator-> () const { return &owner->slots[index].seq; }
+
+        basic_iterator& operator++ () { index = owner->Live(index+1); return *this; }
+        basic_iterator operator++ (int) { basic_iterator tmp(*this); ++*this; return tmp; }
+
+        bool operator== (const basic_iterator& b) const { return index == b.index; }
+        bool operator!= (const basic_iterator& b) const { return index != b.index; }
+
+    private:
+        template<typename O, typename V> friend class basic_iterator;
+        friend struct regexopt_choices;
+        Owner* owner;
+        std::size_t index;
+    };
+
+public:
+    typedef regexopt_sequence value_type;
+    typedef basic_iterator<regexopt_choices, regexopt_sequence> iterator;
+    typedef basic_iterator<const regexopt_choices, const regexopt_sequence> const_iterator;
+
+    regexopt_choices();
+    regexopt_choices(const regexopt_choices& b);
+    regexopt_choices(regexopt_choices&& b);
+    ~regexopt_choices();
+    regexopt_choices& operator= (regexopt_choices b);
+    void swap(regexopt_choices& b);
+
+    iterator begin() { return iterator(this, Live(0)); }
+    iterator end()   { return iterator(this, slots.size()); }
+    const_iterator begin() const { return const_iterator(this, Live(0)); }
+    const_iterator end()   const { return const_iterator(this, slots.size()); }
+
+    std::size_t size() const { return live; }
+    bool empty() const { return !live; }
+
+    void push_back(const regexopt_sequence& seq);
+    void push_back(regexopt_sequence&& seq);
+    void erase(iterator i);
+    void clear();
+
+    /* Removes the dead slots. Invalidates iterators. */
+    void Compact();
+
+    /* Replaces each charset id c in the items by ids[c]. */
+    void RemapCharsets(const std::vector<unsigned>& ids);
+
+    std::size_t hash() const;
+    void Changed() { hash_valid = false; is_frozen = false; is_optimized = false; }
+
+    /* A frozen list is fully optimized and may be shared by
+     * several trees, so the optimizer leaves it as it is. Copies
+     * are not frozen, and modifying the list thaws it. */
+    bool frozen() const { return is_frozen; }
+    void Freeze() { is_frozen = true; }
+
+    /* An optimized list is one that OptimizeTree has finished
+     * with, and that nothing has modified since: optimizing it
+     * again would leave it as it is. Copies stay optimized. */
+    bool optimized() const { return is_optimized; }
+    void MarkOptimized() { is_optimized = true; }
+
+private:
+    std::vector<slot> slots;
+    std::size_t live;
+    mutable std::size_t hash_value;
+    mutable bool hash_valid;
+    bool is_frozen;
+    bool is_optimized;
+
+    /* Index of the first live slot at or after i. */
+    std::size_t Live(std::size_t i) const
+    {
+        while(i < slots.size() && slots[i].dead) ++i;
+        return i;
+    }
+};
+
 
-/* Note: This lib is not yet suitable for production-use.
- * The "tree" pointer in the regexopt_item structure is not properly
- * deallocated. In other words, there's a memory leak.
+/* Owner of the tree nodes ("regexopt_choices") created while
+ * parsing and optimizing. Nodes are carved from large blocks
+ * by bumping a pointer, and are all destroyed at once when the
+ * arena is cleared or destroyed. Nodes that become unreachable
+ * during optimization are simply left for the bulk release.
+ *
+ * The arena also keeps the charsets of the items. Each distinct
+ * charset is stored once and referred to by its id, so items stay
+ * small, and comparing two charsets is comparing two numbers.
  *
- * It should be solved with an autoptr class or something like that.
+ * One arena may be reused for many RegexOptParse calls; call
+ * Clear() between them to keep the memory usage flat.
  */
+class regexopt_arena
+{
+public:
+    regexopt_arena();
+    ~regexopt_arena();
+
+    regexopt_choices* NewChoices();
+    regexopt_choices* NewChoices(const regexopt_choices& src);
+
+    /* Returns the id of the charset, adding it if it is new.
+     * Id 0 is always the empty set. */
+    unsigned Intern(const regexopt_charset& set);
+    const regexopt_charset& charset(unsigned id) const { return charsets[id]; }
+    /* Whether the charset has exactly one member. */
+    bool single(unsigned id) const { return singles[id]; }
+
+    /* Set operations on ids. The results are memoized. */
+    unsigned CharsetUnion(unsigned a, unsigned b);
+    unsigned CharsetIntersection(unsigned a, unsigned b);
+
+    /* For optimizing parts of a tree in other threads, each with an
+     * arena of its own. Fork() gives an empty arena the charsets of
+     * this one, so that the ids mean the same in both. Adopt() takes
+     * over the nodes of such a fork, and adds its new charsets here.
+     * ids is set to the new id of each charset id of the fork. The
+     * nodes of the fork are renumbered, but nodes outside it that
+     * refer to its charsets must be renumbered by the caller. */
+    void Fork(regexopt_arena& child) const;
+    void Adopt(regexopt_arena& child, std::vector<unsigned>& ids);
+
+    /* Destroys all nodes and charsets. The largest block is kept for reuse. */
+    void Clear();
+
+    /* Number of nodes allocated since construction/Clear(). */
+    std::size_t nodes() const { return num_nodes; }
+    /* Number of bytes the nodes occupy, and the number of
+     * bytes reserved from the heap for holding them. */
+    std::size_t bytes() const { return num_nodes * sizeof(regexopt_choices); }
+    std::size_t bytes_reserved() const { return num_reserved; }
+    /* Number of distinct charsets. */
+    std::size_t charset_count() const { return charsets.size(); }
+
+private:
+    struct block;
+    block* blocks;
+    std::size_t num_nodes;
+    std::size_t num_reserved;
+
+    typedef std::unordered_map<unsigned long long, unsigned> memo;
+    std::deque<regexopt_charset> charsets; // deque: references stay valid
+    std::vector<bool> singles;             // single() of each charset
+    std::unordered_map<regexopt_charset, unsigned> charset_ids;
+    memo unions, intersections;
+
+    void* Allocate();
+    void Release(block* keep);
+
+    regexopt_arena(const regexopt_arena&);
+    void operator= (const regexopt_arena&);
+};
+
+#endif
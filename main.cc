@@ -1,21 +1,265 @@
 #include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
 #include "libregex.hh"
+#include "dawg.hh"
+#include "dfa.hh"
+#include "batch.hh"
+#include "prefilter.hh"
+
+static void ReadWords(std::istream& in, regexopt_dawg& dawg)
+{
+    /* The DAWG wants the words in sorted order. */
+    std::vector<std::string> words;
+    std::string line;
+    while(std::getline(in, line))
+    {
+        if(!line.empty() && line[line.size()-1] == '\r') line.erase(line.size()-1);
+        /* An empty word would make the whole list optional. */
+        if(!line.empty()) words.push_back(line);
+    }
+    /* Nor can an empty list be written: the empty regexp matches everything. */
+    if(words.empty()) throw "The word list is empty";
+    std::sort(words.begin(), words.end());
+    for(std::size_t a=0; a<words.size(); ++a)
+        dawg.Add(words[a]);
+    dawg.Finish();
+}
+
+static void Usage()
+{
+    std::cout
+    << "regex-opt " VERSION " — Copyright © 1992, 2006 Bisqwit (http://iki.fi/bisqwit/)\n"
+       "This program is distributed under the terms of the General Public License.\n\n"
+       "\033[0;38;5;103musage:\033[0m \033[0;38;5;65mregex-opt\033[0m [options] \033[0;38;5;101m<regexp>\033[0m\n"
+       "       \033[0;38;5;65mregex-opt\033[0m [options] -w \033[0;38;5;101m<wordfile>\033[0m"
+       "   (one literal word per line, - for stdin;\n"
+       "                                           empty lines are skipped)\n"
+       "       \033[0;38;5;65mregex-opt\033[0m [options] -b \033[0;38;5;101m<file>\033[0m"
+       "       (one regexp per line, - for stdin)\n"
+       "\noptions:\n"
+       "  --repeat-window <n>   Only look for repeated runs up to n items long\n"
+       "                        when compressing \"ababab\" into \"(ab){3}\" (0 = no limit)\n"
+       "  --intern-subtrees     Share the nodes of identical subexpressions\n"
+       "  --stats[=json]        Print the work done by each optimizer pass\n"
+       "                        to stderr, as a table or as JSON\n"
+       "  --max-time <seconds>  Stop optimizing after this long (per regexp),\n"
+       "                        printing the partially optimized result\n"
+       "  --max-steps <n>       Likewise, after n rounds of rewriting\n"
+       "  --objective <goal>    Only rewrite where it does not make the result\n"
+       "                        longer (size) or slower to match (speed)\n"
+       "  --dialect <name>      Write the result for perl (default), pcre2, re2,\n"
+       "                        ere (POSIX extended) or hyperscan\n"
+       "  --possessive          Make quantifiers possessive where that does not\n"
+       "                        change the meaning, and warn about the ones\n"
+       "                        that can still backtrack catastrophically\n"
+       "  --prefilter           Print the result as JSON, with the bytes that a\n"
+       "                        match begins with, its minimum length and the\n"
+       "                        literals that every match contains\n"
+       "  --verify              Check that the result matches the same strings\n"
+       "                        as the regexp (by comparing automata)\n"
+       "  -0, --null            Batch records are separated by NUL, not newline\n"
+       "  -j, --jobs <n>        Number of threads (default: one per CPU)\n"
+       "  --                    End of options\n";
+}
+
+static unsigned ParseUnsigned(const char* opt, const char* s)
+{
+    char* end;
+    unsigned long value = std::strtoul(s, &end, 10);
+    if(!*s || *end || *s == '-' || value > ~0U)
+        throw std::string("Invalid number for ") + opt + ": " + s;
+    return value;
+}
+
+static double ParseSeconds(const char* opt, const char* s)
+{
+    char* end;
+    double value = std::strtod(s, &end);
+    if(!*s || *end || !(value >= 0))
+        throw std::string("Invalid time for ") + opt + ": " + s;
+    return value;
+}
 
 int main(int argc, const char* const* argv)
 {
-    if(argc != 2)
+    const char* wordfile = 0;
+    const char* regexarg = 0;
+    const char* batchfile = 0;
+    regexopt_batch_settings batch;
+    regexopt_options& options = batch.options;
+    regexopt_stats stats;
+    bool stats_json = false;
+    bool partial = false;
+    bool verify = false;
+    bool possessive = false;
+    try {
+        bool opts_done = false;
+        for(int a=1; a<argc; ++a)
+        {
+            const char* arg = argv[a];
+            if(!opts_done && !std::strcmp(arg, "--"))
+                opts_done = true;
+            else if(!opts_done && (!std::strcmp(arg, "-w") || !std::strcmp(arg, "--words")))
+            {
+                if(++a >= argc) throw std::string(arg) + " requires an argument";
+                wordfile = argv[a];
+            }
+            else if(!opts_done && (!std::strcmp(arg, "-b") || !std::strcmp(arg, "--batch")))
+            {
+                if(++a >= argc) throw std::string(arg) + " requires an argument";
+                batchfile = argv[a];
+            }
+            else if(!opts_done && (!std::strcmp(arg, "-0") || !std::strcmp(arg, "--null")))
+                batch.delimiter = '\0';
+            else if(!opts_done && (!std::strcmp(arg, "-j") || !std::strcmp(arg, "--jobs")))
+            {
+                if(++a >= argc) throw std::string(arg) + " requires an argument";
+                batch.threads = ParseUnsigned(arg, argv[a]);
+            }
+            else if(!opts_done && !std::strcmp(arg, "--repeat-window"))
+            {
+                if(++a >= argc) throw std::string(arg) + " requires an argument";
+                options.repeat_window = ParseUnsigned(arg, argv[a]);
+            }
+            else if(!opts_done && !std::strcmp(arg, "--max-time"))
+            {
+                if(++a >= argc) throw std::string(arg) + " requires an argument";
+                options.time_limit = ParseSeconds(arg, argv[a]);
+            }
+            else if(!opts_done && !std::strcmp(arg, "--max-steps"))
+            {
+                if(++a >= argc) throw std::string(arg) + " requires an argument";
+                options.step_limit = ParseUnsigned(arg, argv[a]);
+            }
+            else if(!opts_done && !std::strcmp(arg, "--objective"))
+            {
+                if(++a >= argc) throw std::string(arg) + " requires an argument";
+                if(!std::strcmp(argv[a], "size"))
+                    options.cost_model = &RegexOptSizeCost();
+                else if(!std::strcmp(argv[a], "speed"))
+                    options.cost_model = &RegexOptSpeedCost();
+                else
+                    throw std::string("Invalid objective (size or speed): ") + argv[a];
+            }
+            else if(!opts_done && !std::strcmp(arg, "--dialect"))
+            {
+                if(++a >= argc) throw std::string(arg) + " requires an argument";
+                batch.emitter = RegexOptFindEmitter(argv[a]);
+                if(!batch.emitter)
+                    throw std::string("Invalid dialect (perl, pcre2, re2, ere or hyperscan): ") + argv[a];
+            }
+            else if(!opts_done && !std::strcmp(arg, "--possessive"))
+                batch.possessive = possessive = true;
+            else if(!opts_done && !std::strcmp(arg, "--prefilter"))
+                batch.prefilter = true;
+            else if(!opts_done && !std::strcmp(arg, "--verify"))
+                verify = true;
+            else if(!opts_done && !std::strcmp(arg, "--intern-subtrees"))
+                options.intern_subtrees = true;
+            else if(!opts_done && (!std::strcmp(arg, "--stats") || !std::strcmp(arg, "--stats=json")))
+            {
+                if(!regexopt_stats::enabled)
+                    throw std::string("This regex-opt was compiled without REGEXOPT_STATS");
+                options.stats = &stats;
+                stats_json = arg[7] == '=';
+            }
+            else if(regexarg)
+                throw std::string("Unexpected argument: ") + arg;
+            else
+                regexarg = arg;
+        }
+    }
+    catch(const std::string& s)
+    {
+        std::cout << "\033[0;38;5;103mError: \033[0m" << s.c_str() << std::endl;
+        return -1;
+    }
+    if((wordfile != 0) + (regexarg != 0) + (batchfile != 0) != 1)
     {
-        std::cout
-        << "regex-opt " VERSION " — Copyright © 1992, 2006 Bisqwit (http://iki.fi/bisqwit/)\n"
-           "This program is distributed under the terms of the General Public License.\n\n"
-           "\033[0;38;5;103musage:\033[0m \033[0;38;5;65mregex-opt\033[0m \033[0;38;5;101m<regexp>\033[0m\n";
+        Usage();
         return 0;
     }
+    if(verify && !regexarg)
+    {
+        std::cout << "\033[0;38;5;103mError: \033[0m--verify works on a single regexp" << std::endl;
+        return -1;
+    }
     try {
-        std::string regex = argv[1];
-        unsigned pos=0;
-        regexopt_choices tree = RegexOptParse(regex, pos);
-        DumpRegexOptTree(std::cout, tree);
+        if(batchfile)
+        {
+            std::ios::sync_with_stdio(false);
+            unsigned long failed = RegexOptBatch(batchfile, batch, std::cout, std::cerr);
+            if(options.stats) DumpRegexOptStats(std::cerr, stats, stats_json);
+            return failed ? -1 : 0;
+        }
+
+        options.partial = &partial;
+        options.threads = batch.threads;
+        regexopt_arena arena;
+        regexopt_choices tree;
+        if(wordfile)
+        {
+            regexopt_dawg dawg;
+            if(!std::strcmp(wordfile, "-"))
+                ReadWords(std::cin, dawg);
+            else
+            {
+                std::ifstream f(wordfile, std::ios::binary);
+                if(!f) throw std::string("Cannot open ") + wordfile;
+                ReadWords(f, dawg);
+            }
+            tree = RegexOptWordList(dawg, arena, options);
+        }
+        else
+        {
+            std::string regex = regexarg;
+            unsigned pos=0;
+            tree = RegexOptParse(regex, pos, arena, options);
+        }
+        const regexopt_emitter& emitter = batch.emitter ? *batch.emitter : RegexOptPerlEmitter();
+        std::vector<regexopt_backtracking_warning> warnings;
+        if(possessive)
+            warnings = RegexOptGuardBacktracking(tree, arena, emitter);
+        if(verify)
+        {
+            /* The optimizer rewrites subtrees in place, so parse again.
+             * (The automata take possessive quantifiers as greedy ones.) */
+            unsigned pos = 0;
+            regexopt_choices original = RegexOptParseOnly(regexarg, pos, arena);
+            regexopt_dfa_options dfa;
+            dfa.anchored = true;
+            if(!RegexOptEquivalent(regexopt_dfa(original, arena, dfa),
+                                   regexopt_dfa(tree, arena, dfa)))
+                throw std::string("Verification failed: the result matches different strings");
+        }
+        std::ostringstream out;
+        DumpRegexOptTree(out, tree, arena, emitter);
+        /* ERE cannot escape a newline. */
+        if(out.str().find('\n') != std::string::npos)
+            throw "The result needs a raw newline, which cannot be written on one line";
+        if(warnings.empty() && !batch.prefilter)
+            std::cout << out.str();
+        else
+        {
+            if(batch.prefilter)
+                DumpRegexOptPrefilter(std::cout, RegexOptPrefilter(tree, arena), out.str());
+            else
+                std::cout << out.str();
+            std::cout << std::flush;
+            for(std::size_t a=0; a<warnings.size(); ++a)
+                std::cerr << "regex-opt: warning: " << DescribeRegexOptWarning(warnings[a], out.str()) << '\n';
+        }
+        if(partial)
+            std::cerr << "regex-opt: budget exhausted, result is partially optimized\n";
+        if(options.stats)
+        {
+            std::cout << std::flush;
+            DumpRegexOptStats(std::cerr, stats, stats_json);
+        }
     }
     catch(const char *s)
     {
@@ -0,0 +1,521 @@
+#include <string>
+#include <vector>
+#include <set>
+#include <unordered_map>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+
+#include "prefilter.hh"
+
+/* Prefilter extraction for regex-opt */
+/* Copyright (C) 1992,2006 Bisqwit (http://iki.fi/bisqwit/) */
+
+typedef regexopt_charset charset;
+typedef regexopt_sequence sequence;
+typedef regexopt_choices choices;
+typedef regexopt_item item;
+
+static const unsigned uinf = ~0U;
+
+namespace {
+
+typedef std::set<std::string> Strings;
+
+/* Charsets of up to this many bytes are spelled out, so
+ * that [Ff]oo gives the literals Foo and foo. */
+static const unsigned MaxSpelledSet = 4;
+
+/* What is known about the strings that a part of the regexp
+ * matches. When exact is not known, every match begins with one
+ * of the prefixes and ends with one of the suffixes; "" among
+ * them means that nothing is known. A nullable part always has
+ * "" among its exact strings, or prefixes and suffixes. */
+struct Info
+{
+    bool known;           // exact holds all the strings matched
+    Strings exact;
+    Strings prefix, suffix;
+    std::vector<Strings> factors;
+    charset first;        // bytes that a nonempty match begins with
+    bool nullable;
+    unsigned min_length;
+
+    Info();
+    Info(const Info& b);
+    Info(Info&& b);
+    ~Info();
+    Info& operator= (Info b);
+    void swap(Info& b);
+};
+
+class Analysis
+{
+public:
+    Analysis(const regexopt_arena& a, const regexopt_prefilter_options& o)
+        : arena(a), options(o), memo() { }
+
+    const Info& Tree(const choices& tree);
+    Info Sequence(const sequence& seq);
+    Info Item(const item& it);
+
+    /* Drops the factors that tell nothing or that follow from
+     * better ones, and keeps the best max_factors of the rest. */
+    void Prune(std::vector<Strings>& factors) const;
+
+    const Strings& Prefixes(const Info& i) const { return i.known ? i.exact : i.prefix; }
+    const Strings& Suffixes(const Info& i) const { return i.known ? i.exact : i.suffix; }
+
+private:
+    const regexopt_arena& arena;
+    const regexopt_prefilter_options& options;
+    std::unordered_map<const choices*, Info> memo; // subtrees may be shared
+
+    Info Empty() const;
+    Info Concat(const Info& a, const Info& b) const;
+    Info Alternate(const Info& a, const Info& b) const;
+    Info Repeat(const Info& x, unsigned min, unsigned max) const;
+
+    Strings Cross(const Strings& a, const Strings& b) const;
+    Strings TrimPrefixes(const Strings& s) const;
+    Strings TrimSuffixes(const Strings& s) const;
+    bool Fits(const Strings& s) const;
+    void AddFactor(std::vector<Strings>& factors, const Strings& s) const;
+    void Unknown(Info& i) const;
+};
+
+Info::Info()
+    : known(false), exact(), prefix(), suffix(), factors(), first(), nullable(false), min_length(0)
+{
+}
+
+Info::Info(const Info& b)
+    : known(b.known), exact(b.exact), prefix(b.prefix), suffix(b.suffix), factors(b.factors),
+      first(b.first), nullable(b.nullable), min_length(b.min_length)
+{
+}
+
+Info::Info(Info&& b)
+    : known(false), exact(), prefix(), suffix(), factors(), first(), nullable(false), min_length(0)
+{
+    swap(b);
+}
+
+Info::~Info()
+{
+}
+
+Info& Info::operator= (Info b)
+{
+    swap(b);
+    return *this;
+}
+
+void Info::swap(Info& b)
+{
+    std::swap(known, b.known);
+    exact.swap(b.exact);
+    prefix.swap(b.prefix);
+    suffix.swap(b.suffix);
+    factors.swap(b.factors);
+    std::swap(first, b.first);
+    std::swap(nullable, b.nullable);
+    std::swap(min_length, b.min_length);
+}
+
+static unsigned SaturatingAdd(unsigned a, unsigned b)
+{
+    return a > uinf - b ? uinf : a + b;
+}
+static unsigned SaturatingMul(unsigned a, unsigned b)
+{
+    return a && b > uinf / a ? uinf : a * b;
+}
+
+/* Roughly how many bits of the input a hit saves looking at:
+ * long literals are rare, and each alternative adds to the hits. */
+static double Score(const Strings& s)
+{
+    std::size_t shortest = ~(std::size_t)0;
+    for(Strings::const_iterator i = s.begin(); i != s.end(); ++i)
+        shortest = std::min(shortest, i->size());
+    return shortest - std::log2((double)s.size());
+}
+
+/* Whether every string of a contains one of b,
+ * so that the factor a implies the factor b. */
+static bool Implies(const Strings& a, const Strings& b)
+{
+    for(Strings::const_iterator i = a.begin(); i != a.end(); ++i)
+    {
+        bool found = false;
+        for(Strings::const_iterator j = b.begin(); !found && j != b.end(); ++j)
+            found = i->find(*j) != std::string::npos;
+        if(!found) return false;
+    }
+    return true;
+}
+
+Info Analysis::Empty() const
+{
+    Info i;
+    i.known = true;
+    i.exact.insert(std::string());
+    i.nullable = true;
+    i.min_length = 0;
+    return i;
+}
+
+Strings Analysis::Cross(const Strings& a, const Strings& b) const
+{
+    Strings result;
+    for(Strings::const_iterator i = a.begin(); i != a.end(); ++i)
+        for(Strings::const_iterator j = b.begin(); j != b.end(); ++j)
+            result.insert(*i + *j);
+    return result;
+}
+
+bool Analysis::Fits(const Strings& s) const
+{
+    if(s.size() > options.max_set) return false;
+    for(Strings::const_iterator i = s.begin(); i != s.end(); ++i)
+        if(i->size() > options.max_literal) return false;
+    return true;
+}
+
+/* A match that begins with "abc" also begins with "ab", so
+ * the prefixes can be shortened until there are few enough. */
+Strings Analysis::TrimPrefixes(const Strings& s) const
+{
+    std::size_t length = options.max_literal;
+    for(;;)
+    {
+        Strings result;
+        for(Strings::const_iterator i = s.begin(); i != s.end(); ++i)
+            result.insert(i->substr(0, length));
+        if(result.size() <= options.max_set || !length) return result;
+        --length;
+    }
+}
+Strings Analysis::TrimSuffixes(const Strings& s) const
+{
+    std::size_t length = options.max_literal;
+    for(;;)
+    {
+        Strings result;
+        for(Strings::const_iterator i = s.begin(); i != s.end(); ++i)
+            result.insert(i->size() > length ? i->substr(i->size() - length) : *i);
+        if(result.size() <= options.max_set || !length) return result;
+        --length;
+    }
+}
+
+void Analysis::AddFactor(std::vector<Strings>& factors, const Strings& s) const
+{
+    Strings trimmed = TrimPrefixes(s);
+    if(!trimmed.count(std::string())) factors.push_back(trimmed);
+}
+
+/* Forgets the exact strings, keeping what they tell. */
+void Analysis::Unknown(Info& i) const
+{
+    if(!i.known) return;
+    i.prefix = TrimPrefixes(i.exact);
+    i.suffix = TrimSuffixes(i.exact);
+    AddFactor(i.factors, i.exact);
+    i.known = false;
+    i.exact.clear();
+}
+
+void Analysis::Prune(std::vector<Strings>& factors) const
+{
+    struct local
+    {
+        static bool Better(const Strings& a, const Strings& b)
+        {
+            return Score(a) > Score(b);
+        }
+    };
+    std::stable_sort(factors.begin(), factors.end(), local::Better);
+
+    std::vector<Strings> kept;
+    for(std::size_t a=0; a<factors.size() && kept.size() < options.max_factors; ++a)
+    {
+        /* Worse than the ones kept, so it is only worth keeping if
+         * the matches that pass them would not all pass it too. */
+        bool implied = false;
+        for(std::size_t b=0; !implied && b<kept.size(); ++b)
+            implied = Implies(kept[b], factors[a]) || Implies(factors[a], kept[b]);
+        if(!implied) kept.push_back(factors[a]);
+    }
+    factors.swap(kept);
+}
+
+Info Analysis::Concat(const Info& a, const Info& b) const
+{
+    Info r;
+    r.nullable   = a.nullable && b.nullable;
+    r.min_length = SaturatingAdd(a.min_length, b.min_length);
+    r.first      = a.first;
+    if(a.nullable) r.first |= b.first;
+    r.factors = a.factors;
+    r.factors.insert(r.factors.end(), b.factors.begin(), b.factors.end());
+
+    if(a.known && b.known && a.exact.size() * b.exact.size() <= options.max_set)
+    {
+        r.known = true;
+        r.exact = Cross(a.exact, b.exact);
+        if(!Fits(r.exact)) Unknown(r);
+    }
+    else
+    {
+        r.known = false;
+        r.prefix = a.known ? TrimPrefixes(Cross(a.exact, Prefixes(b))) : a.prefix;
+        r.suffix = b.known ? TrimSuffixes(Cross(Suffixes(a), b.exact)) : b.suffix;
+
+        /* Where the two meet, a suffix of a is followed by a prefix of b. */
+        const Strings& left = Suffixes(a), & right = Prefixes(b);
+        if(left.size() * right.size() <= options.max_set)
+            AddFactor(r.factors, Cross(left, right));
+        else
+        {
+            AddFactor(r.factors, left);
+            AddFactor(r.factors, right);
+        }
+    }
+    Prune(r.factors);
+    return r;
+}
+
+Info Analysis::Alternate(const Info& a, const Info& b) const
+{
+    Info r;
+    r.nullable   = a.nullable || b.nullable;
+    r.min_length = std::min(a.min_length, b.min_length);
+    r.first      = a.first | b.first;
+
+    r.known = a.known && b.known;
+    if(r.known)
+    {
+        r.exact = a.exact;
+        r.exact.insert(b.exact.begin(), b.exact.end());
+        if(r.exact.size() <= options.max_set) return r;
+        r.exact.clear();
+        r.known = false;
+    }
+
+    Strings p = Prefixes(a), s = Suffixes(a);
+    p.insert(Prefixes(b).begin(), Prefixes(b).end());
+    s.insert(Suffixes(b).begin(), Suffixes(b).end());
+    r.prefix = TrimPrefixes(p);
+    r.suffix = TrimSuffixes(s);
+
+    /* A match of either side contains one literal of the best
+     * factor of that side, so it contains one of their union. */
+    const Strings* best[2] = { 0, 0 };
+    const Info* side[2] = { &a, &b };
+    for(unsigned n=0; n<2; ++n)
+    {
+        std::vector<const Strings*> candidates;
+        for(std::size_t f=0; f<side[n]->factors.size(); ++f)
+            candidates.push_back(&side[n]->factors[f]);
+        candidates.push_back(&Prefixes(*side[n]));
+        candidates.push_back(&Suffixes(*side[n]));
+        for(std::size_t c=0; c<candidates.size(); ++c)
+            if(!candidates[c]->count(std::string())
+            && (!best[n] || Score(*candidates[c]) > Score(*best[n])))
+                best[n] = candidates[c];
+    }
+    if(best[0] && best[1])
+    {
+        Strings either = *best[0];
+        either.insert(best[1]->begin(), best[1]->end());
+        AddFactor(r.factors, either);
+    }
+    return r;
+}
+
+Info Analysis::Repeat(const Info& x, unsigned min, unsigned max) const
+{
+    if(min == 1 && max == 1) return x;
+
+    Info r;
+    r.nullable   = min == 0 || x.nullable;
+    r.min_length = SaturatingMul(x.min_length, min);
+    r.first      = x.first;
+
+    if(min == 0)
+    {
+        r.known = max == 1 && x.known && x.exact.size() < options.max_set;
+        if(r.known)
+        {
+            r.exact = x.exact;
+            r.exact.insert(std::string());
+        }
+        else
+        {
+            r.prefix.insert(std::string());
+            r.suffix.insert(std::string());
+        }
+        return r;
+    }
+
+    r.factors = x.factors;
+    r.known = false;
+    if(x.known)
+    {
+        /* A match begins and ends with x{min}, or as much of it as fits. */
+        Strings run = x.exact;
+        unsigned n = 1;
+        for(; n < min; ++n)
+        {
+            Strings next = Cross(run, x.exact);
+            if(!Fits(next)) break;
+            run.swap(next);
+        }
+        if(n == min && max == min)
+        {
+            r.known = true;
+            r.exact.swap(run);
+            return r;
+        }
+        r.prefix = TrimPrefixes(run);
+        r.suffix = TrimSuffixes(run);
+        AddFactor(r.factors, run);
+    }
+    else
+    {
+        r.prefix = x.prefix;
+        r.suffix = x.suffix;
+    }
+    Prune(r.factors);
+    return r;
+}
+
+Info Analysis::Item(const item& it)
+{
+    Info x;
+    if(it.tree)
+        x = Tree(*it.tree);
+    else
+    {
+        const charset& set = arena.charset(it.ch);
+        x.nullable   = false;
+        x.min_length = 1;
+        x.first      = set;
+        x.known      = set.count() <= MaxSpelledSet;
+        if(x.known)
+        {
+            for(unsigned c=set.first(); c<256; c=set.next(c))
+                x.exact.insert(std::string(1, (char)c));
+        }
+        else
+        {
+            x.prefix.insert(std::string());
+            x.suffix.insert(std::string());
+        }
+    }
+    return Repeat(x, it.min, it.max);
+}
+
+Info Analysis::Sequence(const sequence& seq)
+{
+    Info result = Empty();
+    for(sequence::const_iterator i = seq.begin(); i != seq.end(); ++i)
+        result = Concat(result, Item(*i));
+    return result;
+}
+
+const Info& Analysis::Tree(const choices& tree)
+{
+    std::unordered_map<const choices*, Info>::const_iterator m = memo.find(&tree);
+    if(m != memo.end()) return m->second;
+
+    Info result;
+    bool first = true;
+    for(choices::const_iterator i = tree.begin(); i != tree.end(); ++i)
+    {
+        if(first) { result = Sequence(*i); first = false; }
+        else result = Alternate(result, Sequence(*i));
+    }
+    if(first) result = Empty(); // printed as (?:)
+    Prune(result.factors);
+    return memo[&tree] = result;
+}
+
+static void DumpJsonString(std::ostream& out, const std::string& s)
+{
+    out << '"';
+    for(std::size_t a=0; a<s.size(); ++a)
+    {
+        unsigned char c = s[a];
+        if(c == '"' || c == '\\')
+            out << '\\' << c;
+        else if(c >= 0x20 && c < 0x7F)
+            out << c;
+        else
+        {
+            char Buf[8];
+            std::sprintf(Buf, "\\u%04X", c);
+            out << Buf;
+        }
+    }
+    out << '"';
+}
+
+} // namespace
+
+regexopt_prefilter RegexOptPrefilter(const regexopt_choices& tree, const regexopt_arena& arena,
+                                     const regexopt_prefilter_options& options)
+{
+    Analysis analysis(arena, options);
+    Info info = analysis.Tree(tree);
+
+    regexopt_prefilter result;
+    result.min_length  = info.min_length;
+    result.first_bytes = info.first;
+    if(info.nullable) result.first_bytes.set();
+
+    std::vector<Strings> factors = info.factors;
+    factors.push_back(analysis.Prefixes(info));
+    factors.push_back(analysis.Suffixes(info));
+    for(std::size_t a=factors.size(); a-- > 0; )
+        if(factors[a].count(std::string()) || factors[a].empty())
+            factors.erase(factors.begin() + a);
+    analysis.Prune(factors);
+
+    for(std::size_t a=0; a<factors.size(); ++a)
+        result.factors.push_back(std::vector<std::string>(factors[a].begin(), factors[a].end()));
+    return result;
+}
+
+void DumpRegexOptPrefilter(std::ostream& out, const regexopt_prefilter& prefilter,
+                           const std::string& regex)
+{
+    out << "{\"regex\":";
+    DumpJsonString(out, regex);
+    out << ",\"min_length\":" << prefilter.min_length
+        << ",\"first_bytes\":[";
+    bool first = true;
+    const charset& bytes = prefilter.first_bytes;
+    for(unsigned c=bytes.first(); c<256; )
+    {
+        unsigned end = c;
+        while(end+1 < 256 && bytes[end+1]) ++end;
+        out << (first ? "" : ",") << '[' << c << ',' << end << ']';
+        first = false;
+        c = bytes.next(end);
+    }
+    out << "],\"factors\":[";
+    for(std::size_t f=0; f<prefilter.factors.size(); ++f)
+    {
+        out << (f ? ",[" : "[");
+        for(std::size_t s=0; s<prefilter.factors[f].size(); ++s)
+        {
+            if(s) out << ',';
+            DumpJsonString(out, prefilter.factors[f][s]);
+        }
+        out << ']';
+    }
+    out << "]}";
+}
@@ -0,0 +1,56 @@
+#ifndef bqtPrefilterHH
+#define bqtPrefilterHH
+
+#include <string>
+#include <vector>
+#include <ostream>
+#include "libregex.hh"
+
+/***************
+ *
+ * What a scanner can check cheaply before running a regexp over
+ * the input: the bytes that a match can begin with, the length of
+ * the shortest match, and literals that every match contains.
+ *
+ * The literals are in conjunctive form. Each factor is a set of
+ * strings of which every match contains at least one, and all the
+ * factors hold at once. So the scanner can look for the strings of
+ * any one factor (with memchr, memmem or a multi-literal search such
+ * as Teddy), and run the regexp only around the places found.
+ *
+ * The analysis keeps the literals short and the sets small, as set
+ * in the options. What it reports always holds for every match,
+ * but it may find fewer factors than there are.
+ */
+struct regexopt_prefilter
+{
+    regexopt_charset first_bytes; // all bytes, if a match can be empty
+    unsigned min_length;
+    std::vector<std::vector<std::string> > factors; // most selective first
+};
+
+struct regexopt_prefilter_options
+{
+    unsigned max_literal; // longest string in a factor
+    unsigned max_set;     // most strings in a factor
+    unsigned max_factors; // factors kept
+
+    regexopt_prefilter_options(): max_literal(32), max_set(16), max_factors(4) { }
+};
+
+regexopt_prefilter RegexOptPrefilter(const regexopt_choices& tree, const regexopt_arena& arena,
+                                     const regexopt_prefilter_options& options
+                                         = regexopt_prefilter_options());
+
+/* Prints the prefilter of the given regexp as one line of JSON:
+ *
+ *   {"regex":"...","min_length":3,"first_bytes":[[97,99]],
+ *    "factors":[["abc"],["xy","z"]]}
+ *
+ * first_bytes lists the ranges of byte values. The strings are
+ * bytes: those above 0x7F are written as \u0080 to \u00FF.
+ */
+void DumpRegexOptPrefilter(std::ostream& out, const regexopt_prefilter& prefilter,
+                           const std::string& regex);
+
+#endif
@@ -20,6 +20,95 @@ Example:<br>
 x[a-c]z</code>
 <p>
 
+To build a regexp matching exactly a list of literal words
+(such as a keyword or domain blocklist), give the words one per line:<br>
+<code>regex-opt -w words.txt</code>
+(or <code>-w -</code> to read them from stdin). Empty lines are skipped,
+and a list with no words is an error.
+The words are compiled into a minimal automaton first, so even
+hundreds of thousands of words are handled in linear time.
+<p>
+
+Long sequences are searched for repeated runs (such as <code>ababab</code>,
+which becomes <code>(?:ab){3}</code>) in roughly n log<sup>2</sup> n time.
+To only look for runs up to n items long, add <code>--repeat-window n</code>:<br>
+<code>regex-opt --repeat-window 8 &lt;regexp></code>
+<p>
+To optimize many regexps at once, give them one per line in a file
+(or <code>-</code> for stdin):<br>
+<code>regex-opt -b rules.txt > optimized.txt</code><br>
+They are optimized in parallel (<code>-j n</code> sets the number of
+threads), and the results are written one per line in the same order.
+A line that cannot be parsed is reported on stderr and produces an
+empty result line. With <code>-0</code>, the records are separated
+by NUL characters instead of newlines.
+A single large regexp is optimized in parallel too: groups of more
+than a few hundred items are handed to the threads as soon as they
+are parsed. The result is the same for any number of threads.
+<p>
+With <code>--intern-subtrees</code>, identical subexpressions share
+one node while optimizing, which saves memory on inputs that repeat
+the same groups many times.
+<p>
+To bound the time spent on a pathological input, give
+<code>--max-time &lt;seconds&gt;</code> or <code>--max-steps &lt;n&gt;</code>
+(rounds of rewriting): when the budget runs out, the optimizer stops
+and prints the best regexp it has so far, which is still equivalent
+to the input, and a note on stderr. In batch mode the budget applies
+to each regexp separately.
+<p>
+To see where the time goes, add <code>--stats</code>: the number of
+calls, loop rounds, nodes examined and rewrites applied by each
+optimizer pass, and the time spent in it, are printed on stderr.
+<code>--stats=json</code> prints them as one line of JSON.
+(The counters exist only when compiled with <code>REGEXOPT_STATS</code>,
+which the Makefile defines.)
+<p>
+The rewrites are normally chosen by structure alone, which does not
+always give the shortest or the fastest regexp: <code>(?:ab){3}</code>
+is longer than <code>ababab</code>, and slower to match with most
+engines. With <code>--objective size</code>, a rewrite is only made
+if it does not make the result longer; with <code>--objective speed</code>,
+if it does not make it slower to match by the estimate of a
+backtracking matcher (counting byte tests, alternatives tried,
+iterations of nested quantifiers and how many bytes can begin a match).
+<p>
+With <code>--verify</code>, the input and the result are both compiled
+into deterministic automata, and regex-opt fails with an error unless
+they match exactly the same strings. (The automata are limited to
+10000 states; a regexp that needs more is reported as too large.)
+<p>
+With <code>--possessive</code>, quantifiers that can never need to give
+back what they matched are made possessive (<code>[a-z]+\\d</code> becomes
+<code>[a-z]++[\\d]</code>, and <code>(?:a+)+b</code> becomes <code>a++b</code>),
+so that a backtracking matcher fails fast instead of trying every way
+of dividing the text. The result needs an engine with possessive
+quantifiers (PCRE, Java, Python 3.11). Adjacent or nested quantifiers
+that can still divide the same text in many ways are reported on stderr.
+<p>
+The result is written in Perl syntax, unless <code>--dialect</code>
+names another: <code>pcre2</code>, <code>re2</code>, <code>ere</code>
+(POSIX extended) or <code>hyperscan</code>. Each is written with the
+shortest constructs that the dialect has, leaving out the ones that it
+lacks: RE2 gets no <code>\\e</code> escapes, POSIX no <code>(?:</code>
+groups nor <code>\\d</code>, and counts over the limit of the engine
+(such as 1000 in RE2) are split. The POSIX result assumes line-based
+matching, as in <code>grep -E</code> or with <code>REG_NEWLINE</code>:
+<code>.</code> is printed for Perl's <code>.</code>, although it would
+also match a newline without <code>REG_NEWLINE</code>. POSIX has no
+escape for a newline either, so a result that needs a literal one is
+reported as an error (in batch mode with <code>-0</code>, it is written
+as is).
+<p>
+With <code>--prefilter</code>, regex-opt prints instead what a scanner
+can test before running the regexp, as one line of JSON: the bytes that
+a match can begin with, the length of the shortest match, and sets of
+literals of which every match contains at least one string from each
+(for <code>[Ee]rror: .*timeout</code>, <code>["timeout"]</code> and
+<code>["Error: ","error: "]</code>). In batch mode, one line is printed
+for each regexp.
+<p>
+
 Try running regex-opt on
 <a href=\"http://www.foad.org/%7Eabigail/\">Abigail</a>'s 7 kilobyte
 <a href=\"http://www.foad.org/~abigail/Perl/url3.regex\">URL regexp</a>.
@@ -65,9 +154,10 @@ The result should be about 5 kilobytes long.
  <li>Parenthesis reduction: ((abc)) becomes abc, (xx|yy)|zz becomes xx|yy|zz</li>
  <li>Compression: xyzyzxyzyz becomes (?:x(?:yz){2}){2}
   <ul>
-   <li>This might not be always a good thing.</li>
+   <li>This might not be always a good thing. See <code>--objective</code>.</li>
   </ul></li>
  <li>Choice counting: a+|aa+ becomes a+, (b|) becomes b?, dxxxxb|dxxxb|dxxb|dxb becomes dx{1,4}b</li>
+ <li>Redundancy removal: alternatives that are subsets of other alternatives are removed, xfooy|x[a-q]+y becomes x[a-q]+y</li>
 </ul>
 
 ", '1. Optimizations not performed' => "
@@ -77,10 +167,6 @@ The result should be about 5 kilobytes long.
   <ul>
    <li>a?|b? should become (?:a|b)?, now becomes a?|b?</li>
   </ul></li>
- <li>Redundancy removal (removal of alternatives that are subsets of other alternatives):
-  <ul>
-   <li>xfooy|x[a-q]+y should become x[a-q]+y, now becomes x(?:foo|[a-q]+)y</li>
-  </ul></li>
 </ul>
 Help in solving these shortcomings would be welcome.
 
@@ -2,6 +2,11 @@
 #define bqt_RangeHH
 
 #include <map>
+#include <vector>
+#include <memory>
+#include <iterator>
+#include <algorithm>
+#include <cstddef>
 
 template<typename Key>
 struct rangetype
@@ -39,12 +44,88 @@ struct rangetype
 };
 
 
-template<typename Key, typename Valueholder, typename Allocator = std::allocator<Key> >
-class rangecollection
+/* Given as the Allocator of a rangecollection or rangeset, this
+ * makes it keep the changepoints in a sorted vector instead of a
+ * std::map: the first N of them within the object itself, and the
+ * rest on the heap from Allocator. Building and walking a small set
+ * then allocates nothing, but each change in the middle of a large
+ * one moves the changepoints after it. */
+template<unsigned N, typename Allocator = std::allocator<char> >
+struct flat_ranges { };
+
+/* The part of the std::map interface that rangecollection uses,
+ * over a sorted vector with room for N elements in place. */
+template<typename Key, typename Value, unsigned N, typename Allocator>
+class flat_rangemap
+{
+public:
+    typedef std::pair<Key, Value> value_type;
+    typedef value_type* iterator;
+    typedef const value_type* const_iterator;
+    typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
+    typedef std::size_t size_type;
+
+    flat_rangemap(): local(), count(0), heap() { }
+
+    iterator begin()             { return heap.empty() ? local : &heap[0]; }
+    iterator end()               { return begin() + size(); }
+    const_iterator begin() const { return heap.empty() ? local : &heap[0]; }
+    const_iterator end() const   { return begin() + size(); }
+    const_reverse_iterator rbegin() const { return const_reverse_iterator(end()); }
+    const_reverse_iterator rend() const   { return const_reverse_iterator(begin()); }
+
+    size_type size() const { return heap.empty() ? count : heap.size(); }
+    bool empty() const { return !size(); }
+    void clear() { heap.clear(); count = 0; }
+
+    iterator lower_bound(const Key& k) { return std::lower_bound(begin(), end(), k, KeyLess()); }
+    iterator upper_bound(const Key& k) { return std::upper_bound(begin(), end(), k, KeyLess()); }
+    const_iterator lower_bound(const Key& k) const { return std::lower_bound(begin(), end(), k, KeyLess()); }
+    const_iterator upper_bound(const Key& k) const { return std::upper_bound(begin(), end(), k, KeyLess()); }
+
+    /* Like std::map: does nothing if the key is already there. */
+    std::pair<iterator, bool> insert(const value_type& v);
+    iterator erase(iterator first, iterator last);
+    iterator erase(iterator i) { return erase(i, i+1); }
+
+    bool operator==(const flat_rangemap& b) const
+    {
+        return size() == b.size() && std::equal(begin(), end(), b.begin());
+    }
+
+private:
+    struct KeyLess
+    {
+        bool operator() (const value_type& a, const Key& k) const { return a.first < k; }
+        bool operator() (const Key& k, const value_type& a) const { return k < a.first; }
+    };
+
+    /* The elements are in local[0..count) until there are more than
+     * N of them; from then on, until the heap is empty, in heap. */
+    value_type local[N];
+    unsigned count;
+    std::vector<value_type,
+        typename Allocator::template rebind<value_type>::other> heap;
+};
+
+/* Chooses where a rangecollection keeps its changepoints. */
+template<typename Key, typename Valueholder, typename Allocator>
+struct rangecontainer
 {
     typedef std::map<Key, Valueholder, std::less<Key>,
       typename Allocator::template rebind<std::pair<const Key, Valueholder> >::other
-                    > Cont;
+                    > type;
+};
+template<typename Key, typename Valueholder, unsigned N, typename Allocator>
+struct rangecontainer<Key, Valueholder, flat_ranges<N, Allocator> >
+{
+    typedef flat_rangemap<Key, Valueholder, N, Allocator> type;
+};
+
+template<typename Key, typename Valueholder, typename Allocator = std::allocator<Key> >
+class rangecollection
+{
+    typedef typename rangecontainer<Key, Valueholder, Allocator>::type Cont;
     Cont data;
 public:
     rangecollection(): data() {}
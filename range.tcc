@@ -1,6 +1,47 @@
 #include <algorithm> // for std::max, std::min
 #include "range.hh"
 
+template<typename Key, typename Value, unsigned N, typename Allocator>
+std::pair<typename flat_rangemap<Key,Value,N,Allocator>::iterator, bool>
+    flat_rangemap<Key,Value,N,Allocator>::insert(const value_type& v)
+{
+    iterator i = lower_bound(v.first);
+    if(i != end() && i->first == v.first) return std::make_pair(i, false);
+
+    std::size_t pos = i - begin();
+    if(heap.empty() && count < N)
+    {
+        std::copy_backward(local+pos, local+count, local+count+1);
+        local[pos] = v;
+        ++count;
+        return std::make_pair(local+pos, true);
+    }
+    if(heap.empty())
+    {
+        /* Move to the heap. */
+        heap.reserve(2*N + 1);
+        heap.assign(local, local+count);
+        count = 0;
+    }
+    heap.insert(heap.begin() + pos, v);
+    return std::make_pair(&heap[pos], true);
+}
+
+template<typename Key, typename Value, unsigned N, typename Allocator>
+typename flat_rangemap<Key,Value,N,Allocator>::iterator
+    flat_rangemap<Key,Value,N,Allocator>::erase(iterator first, iterator last)
+{
+    std::size_t pos = first - begin(), n = last - first;
+    if(heap.empty())
+    {
+        std::copy(local+pos+n, local+count, local+pos);
+        count -= n;
+        return local+pos;
+    }
+    heap.erase(heap.begin()+pos, heap.begin()+pos+n);
+    return begin()+pos;
+}
+
 /* map::lower_bound(k) = find the first element whose key >= k */
 /* map::upper_bound(k) = find the first element whose key > k */
 
@@ -34,13 +75,7 @@ void rangecollection<Key,Valueholder,Allocator>::erase(const Key& lo, const Key&
     /*
      -  Erase all elements that are left inside our range
     */
-    for(typename Cont::iterator j,i = data.lower_bound(lo);
-        i != data.end() && i->first < up;
-        i=j)
-    {
-        j=i; ++j;
-        data.erase(i);
-    }
+    data.erase(data.lower_bound(lo), data.lower_bound(up));
 
     /*
      -  Find what was going on before <lo>
@@ -68,8 +103,9 @@ void rangecollection<Key,Valueholder,Allocator>::erase_before(const Key& lo)
 {
     if(!empty())
     {
-        const_iterator b = begin();
-        if(b->first < lo) erase(b->first, lo);
+        /* Copied, because erase() removes the element it is in. */
+        const Key first = begin()->first;
+        if(first < lo) erase(first, lo);
     }
 }
 
@@ -78,8 +114,8 @@ void rangecollection<Key,Valueholder,Allocator>::erase_after(const Key& hi)
 {
     if(!empty())
     {
-        typename Cont::const_reverse_iterator b = data.rbegin();
-        if(b->first > hi) erase(hi, b->first);
+        const Key last = data.rbegin()->first;
+        if(last > hi) erase(hi, last);
     }
 }
 
@@ -122,13 +158,7 @@ void rangecollection<Key,Valueholder,Allocator>::set(const Key& lo, const Key& u
     /*
      -  Erase all elements that are left inside our range
     */
-    for(typename Cont::iterator j,i = data.lower_bound(lo);
-        i != data.end() && i->first < up;
-        i=j)
-    {
-        j=i; ++j;
-        data.erase(i);
-    }
+    data.erase(data.lower_bound(lo), data.lower_bound(up));
 
     /*
      -  Find what was going on before <lo>